@@ -0,0 +1,392 @@
+//gwp-bench: benchmark of the profile overhead and accuracy
+//gwp-bench [-d depth] [-t threads] [-n calls] [-e error%] [-m nsecs] [-o results.csv]
+//compile profile.c together with gwp-bench with -DPROFILE
+//and the counter and options to be benchmarked, the results are written as
+//CSV to stdout or to results.csv
+
+#include "profile_report.h"
+
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef PROFILE
+#error "compile gwp-bench with -DPROFILE"
+#endif
+
+#define NSECS_PER_SEC 1000000000LL
+
+local void usage(void)
+{
+  fprintf(stderr, "usage: gwp-bench [-d depth] [-t threads] [-n calls] "
+                  "[-e error%%] [-m nsecs] [-o results.csv]\n");
+  exit(EXIT_FAILURE);
+}
+
+local long long thread_nsecs(void)
+{
+  struct timespec tv;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tv);
+
+  return(tv.tv_sec * NSECS_PER_SEC + tv.tv_nsec);
+}
+
+//a nest of depth d makes d + 1 nested BEGIN_BLOCK/END_BLOCK pairs,
+//nest_bare does the same without the blocks
+
+local volatile int nest_sink;
+
+local void __attribute__((noinline)) nest_bare(int depth)
+{
+  nest_sink++;
+
+  if (depth > 0) nest_bare(depth - 1);
+
+  __asm__ volatile("" ::: "memory");
+}
+
+local void __attribute__((noinline)) nest(int depth)
+{
+  BEGIN_BLOCK("bench-nest")
+
+  nest_sink++;
+
+  if (depth > 0) nest(depth - 1);
+
+  END_BLOCK
+}
+
+typedef struct
+{
+  int depth;
+  long long ncall;
+  double nsecs_pair;
+} overhead_t;
+
+//the overhead of a pair is measured with the CPU time of the thread,
+//so threads that share a core do not disturb each other
+
+local void *overhead(void *arg)
+{
+  overhead_t *with = arg;
+
+  PROFILE_THREAD_BEGIN
+
+  //create the blocks before the calls are timed
+
+  nest(with->depth);
+
+  long long begin = thread_nsecs();
+
+  for (long long icall = 0; icall < with->ncall; icall++)
+    nest_bare(with->depth);
+
+  long long nsecs_bare = thread_nsecs() - begin;
+
+  begin = thread_nsecs();
+
+  for (long long icall = 0; icall < with->ncall; icall++)
+    nest(with->depth);
+
+  long long nsecs_profiled = thread_nsecs() - begin;
+
+  with->nsecs_pair = (double) (nsecs_profiled - nsecs_bare) /
+                     (double) (with->ncall * (with->depth + 1));
+
+  return(NULL);
+}
+
+//spin costs a known number of nanoseconds per iteration that is measured
+//without the profiler
+
+local volatile double spin_sink;
+
+local void __attribute__((noinline)) spin(long long n)
+{
+  double x = spin_sink;
+
+  for (long long i = 0; i < n; i++) x = x * 0.999999 + 1.0;
+
+  spin_sink = x;
+}
+
+#define NSPIN_CALIBRATION 1000000LL
+#define NSPIN_REPEAT      10
+
+local double spin_nsecs;
+
+local void calibrate_spin(void)
+{
+  spin_nsecs = 0.0;
+
+  for (int irepeat = 0; irepeat < NSPIN_REPEAT; irepeat++)
+  {
+    long long begin = thread_nsecs();
+
+    spin(NSPIN_CALIBRATION);
+
+    double nsecs = (double) (thread_nsecs() - begin) / NSPIN_CALIBRATION;
+
+    if ((irepeat == 0) or (nsecs < spin_nsecs)) spin_nsecs = nsecs;
+  }
+}
+
+//the workloads of the accuracy benchmark run for about WORKLOAD_NSECS
+
+#define WORKLOAD_NSECS (20000000LL)
+
+local long long return_ncall(double nsecs_call)
+{
+  long long ncall = (long long) (WORKLOAD_NSECS / nsecs_call);
+
+  return(ncall < 1000 ? 1000 : ncall);
+}
+
+local FILE *results;
+
+local int failed = FALSE;
+local double error_max = -1.0;
+local double nsecs_max = -1.0;
+
+local void write_result(const char *benchmark, int nthread, int depth,
+  long long ncall, double expected, double measured)
+{
+  fprintf(results, "%s,%s,%d,%d,%lld,", benchmark, PROFILE_COUNTER_NAME,
+          nthread, depth, ncall);
+
+  if (expected < 0.0)
+    fprintf(results, ",%.3f,\n", measured);
+  else if (expected == 0.0)
+    fprintf(results, "%.3f,%.3f,\n", expected, measured);
+  else
+  {
+    double error = 100.0 * (measured - expected) / expected;
+
+    fprintf(results, "%.3f,%.3f,%.3f\n", expected, measured, error);
+
+    if ((error_max >= 0.0) && (fabs(error) > error_max))
+    {
+      fprintf(stderr, "gwp-bench: %s is off by %.3f%%\n", benchmark, error);
+
+      failed = TRUE;
+    }
+  }
+}
+
+//the profile of the main thread is copied with query_profile, so the
+//blocks are measured as they are reported and no profile is written
+
+local profile_t *return_profile(void)
+{
+  static profile_t with;
+
+  free_profile(&with);
+
+  query_profile(&with, PID);
+
+  return(&with);
+}
+
+local block_t *return_block(profile_t *with, const char *name)
+{
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    block_t *with_block = BLOCK(with, iblock);
+
+    if ((strcmp(with_block->block_name, name) == 0) &&
+        (with_block->block_invocation == 1)) return(with_block);
+  }
+
+  fprintf(stderr, "gwp-bench: block %s not found\n", name);
+
+  exit(EXIT_FAILURE);
+}
+
+#define NSECS_CALL(B, T) \
+  ((B)->block_calls == 0 ? 0.0 :\
+   (double) NSECS_PER_SEC * (B)->T / (double) (B)->block_calls)
+
+//a block around a spin of nsecs_target, a block without code should
+//have a self time of zero
+
+local void accuracy_leaf(double nsecs_target)
+{
+  long long nspin = (long long) (nsecs_target / spin_nsecs);
+
+  long long ncall = return_ncall(nsecs_target + 100.0);
+
+  CLEAR_PROFILE
+
+  for (long long icall = 0; icall < ncall; icall++)
+  {
+    BEGIN_BLOCK("bench-leaf")
+
+    if (nspin > 0) spin(nspin);
+
+    END_BLOCK
+  }
+
+  block_t *with_block = return_block(return_profile(), "bench-leaf");
+
+  write_result(nspin == 0 ? "empty-self" : "leaf-self", 1, 0,
+               with_block->block_calls, nspin * spin_nsecs,
+               NSECS_CALL(with_block, block_time_self_total));
+}
+
+//a parent that spins and calls a child that spins, the self time of the
+//child should not leak into the parent
+
+local void accuracy_nested(double nsecs_parent, double nsecs_child)
+{
+  long long nspin_parent = (long long) (nsecs_parent / spin_nsecs);
+  long long nspin_child = (long long) (nsecs_child / spin_nsecs);
+
+  long long ncall = return_ncall(nsecs_parent + nsecs_child + 200.0);
+
+  CLEAR_PROFILE
+
+  for (long long icall = 0; icall < ncall; icall++)
+  {
+    BEGIN_BLOCK("bench-parent")
+
+    spin(nspin_parent);
+
+    BEGIN_BLOCK("bench-child")
+
+    spin(nspin_child);
+
+    END_BLOCK
+
+    END_BLOCK
+  }
+
+  profile_t *with = return_profile();
+
+  block_t *with_parent = return_block(with, "bench-parent");
+  block_t *with_child = return_block(with, "bench-child");
+
+  write_result("nested-parent-self", 1, 1, with_parent->block_calls,
+               nspin_parent * spin_nsecs,
+               NSECS_CALL(with_parent, block_time_self_total));
+
+  write_result("nested-parent-total", 1, 1, with_parent->block_calls,
+               (nspin_parent + nspin_child) * spin_nsecs,
+               NSECS_CALL(with_parent, block_time_total));
+
+  write_result("nested-child-self", 1, 1, with_child->block_calls,
+               nspin_child * spin_nsecs,
+               NSECS_CALL(with_child, block_time_self_total));
+}
+
+local void benchmark_overhead(int nthread, int depth, long long ncall)
+{
+  overhead_t *with;
+  pthread_t *threads;
+
+  PROFILE_BUG((with = calloc(nthread, sizeof(overhead_t))) == NULL)
+  PROFILE_BUG((threads = calloc(nthread, sizeof(pthread_t))) == NULL)
+
+  for (int ithread = 0; ithread < nthread; ithread++)
+  {
+    with[ithread].depth = depth;
+    with[ithread].ncall = ncall;
+
+    PROFILE_BUG(pthread_create(threads + ithread, NULL, overhead,
+                               with + ithread) != 0)
+  }
+
+  double nsecs_pair = 0.0;
+
+  for (int ithread = 0; ithread < nthread; ithread++)
+  {
+    PROFILE_BUG(pthread_join(threads[ithread], NULL) != 0)
+
+    nsecs_pair += with[ithread].nsecs_pair;
+  }
+
+  nsecs_pair /= nthread;
+
+  write_result("overhead-pair", nthread, depth, ncall, -1.0, nsecs_pair);
+
+  if ((nsecs_max >= 0.0) && (nsecs_pair > nsecs_max))
+  {
+    fprintf(stderr, "gwp-bench: the overhead of %d threads at depth %d "
+                    "is %.3f nsecs\n", nthread, depth, nsecs_pair);
+
+    failed = TRUE;
+  }
+
+  free(threads);
+  free(with);
+}
+
+int main(int argc, char **argv)
+{
+  int depth_max = 4;
+  int nthread_max = 64;
+  long long ncall = 10000;
+  const char *name = NULL;
+
+  for (int iarg = 1; iarg < argc; iarg++)
+  {
+    if (iarg + 1 >= argc) usage();
+
+    if (strcmp(argv[iarg], "-d") == 0)
+      depth_max = atoi(argv[++iarg]);
+    else if (strcmp(argv[iarg], "-t") == 0)
+      nthread_max = atoi(argv[++iarg]);
+    else if (strcmp(argv[iarg], "-n") == 0)
+      ncall = atoll(argv[++iarg]);
+    else if (strcmp(argv[iarg], "-e") == 0)
+      error_max = atof(argv[++iarg]);
+    else if (strcmp(argv[iarg], "-m") == 0)
+      nsecs_max = atof(argv[++iarg]);
+    else if (strcmp(argv[iarg], "-o") == 0)
+      name = argv[++iarg];
+    else
+      usage();
+  }
+
+  if ((depth_max < 0) or (nthread_max < 1) or (ncall < 1)) usage();
+
+  results = stdout;
+
+  if (name != NULL) PROFILE_BUG((results = fopen(name, "w")) == NULL)
+
+  INIT_PROFILE
+
+  calibrate_spin();
+
+  fprintf(results, "benchmark,counter,threads,depth,calls,"
+                   "expected_nsecs,measured_nsecs,error_percent\n");
+
+  //accuracy
+
+  accuracy_leaf(0.0);
+  accuracy_leaf(100.0);
+  accuracy_leaf(1000.0);
+  accuracy_leaf(10000.0);
+  accuracy_leaf(100000.0);
+
+  accuracy_nested(100.0, 100.0);
+  accuracy_nested(1000.0, 10000.0);
+  accuracy_nested(10000.0, 1000.0);
+
+  //overhead for 1, 2, 4.. threads
+
+  for (int nthread = 1; ; nthread *= 2)
+  {
+    if (nthread > nthread_max) nthread = nthread_max;
+
+    for (int depth = 0; depth <= depth_max; depth++)
+      benchmark_overhead(nthread, depth, ncall);
+
+    if (nthread == nthread_max) break;
+  }
+
+  if (results != stdout) fclose(results);
+
+  return(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,193 @@
+//gwp-report: offline reporter for binary profiles dumped with -DPROFILE_BINARY
+//gwp-report [-v] [-s calls|self|total] profile.gwp..
+//gwp-report -N [-v] [-s calls|self|total] profile.gwp..
+//gwp-report -d [-n sigmas] before.gwp after.gwp
+//the profiles are merged and the report is written to stdout, or with -d
+//the blocks of two profiles are compared
+//with -N the profiles of the processes of a host are merged first, so the
+//minimum, maximum and imbalance of the report are over the hosts
+
+#include "profile_report.h"
+
+#include <string.h>
+
+local void usage(void)
+{
+  fprintf(stderr, "usage: gwp-report [-N] [-v] [-s calls|self|total] profile.gwp..\n"
+                  "       gwp-report -d [-n sigmas] before.gwp after.gwp\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+  int verbose = FALSE;
+  int sort_key = SORT_DEFAULT;
+  int diff = FALSE;
+  int nodes = FALSE;
+  double nsigma = 3.0;
+
+  int iarg = 1;
+
+  for (; iarg < argc; iarg++)
+  {
+    if (strcmp(argv[iarg], "-v") == 0)
+    {
+      verbose = TRUE;
+    }
+    else if (strcmp(argv[iarg], "-s") == 0)
+    {
+      if (++iarg >= argc) usage();
+
+      if (strcmp(argv[iarg], "calls") == 0)
+        sort_key = SORT_CALLS;
+      else if (strcmp(argv[iarg], "self") == 0)
+        sort_key = SORT_SELF;
+      else if (strcmp(argv[iarg], "total") == 0)
+        sort_key = SORT_TOTAL;
+      else
+        usage();
+    }
+    else if (strcmp(argv[iarg], "-d") == 0)
+    {
+      diff = TRUE;
+    }
+    else if (strcmp(argv[iarg], "-N") == 0)
+    {
+      nodes = TRUE;
+    }
+    else if (strcmp(argv[iarg], "-n") == 0)
+    {
+      if (++iarg >= argc) usage();
+
+      nsigma = atof(argv[iarg]);
+
+      if (nsigma < 0.0) usage();
+    }
+    else if (argv[iarg][0] == '-')
+    {
+      usage();
+    }
+    else
+    {
+      break;
+    }
+  }
+
+  if (iarg >= argc) usage();
+
+  if (diff && nodes) usage();
+
+  if (diff)
+  {
+    if (iarg != argc - 2) usage();
+
+    //merging builds the hash tables that match the blocks
+
+    profile_t merged[2];
+
+    for (int iprofile = 0; iprofile < 2; iprofile++)
+    {
+      profile_t with;
+
+      read_profile(argv[iarg + iprofile], &with);
+
+      memset(merged + iprofile, 0, sizeof(profile_t));
+
+      merge_profile(merged + iprofile, &with);
+
+      free_profile(&with);
+    }
+
+    diff_profile(stdout, merged, merged + 1, nsigma);
+
+    free_profile(merged);
+    free_profile(merged + 1);
+
+    return(EXIT_SUCCESS);
+  }
+
+  profile_t merged;
+
+  memset(&merged, 0, sizeof(profile_t));
+
+  if (nodes)
+  {
+    //the profiles of a host are merged in the order of the arguments,
+    //a profile without a host name is a host of its own
+
+    int nnode = 0;
+    profile_t *node;
+
+    PROFILE_BUG((node = calloc(argc - iarg, sizeof(profile_t))) == NULL)
+
+    for (; iarg < argc; iarg++)
+    {
+      profile_t with;
+
+      read_profile(argv[iarg], &with);
+
+      int inode = 0;
+
+      if (with.profile_host[0] != '\0')
+      {
+        for (; inode < nnode; inode++)
+          if (strcmp(node[inode].profile_host, with.profile_host) == 0) break;
+      }
+      else
+      {
+        inode = nnode;
+      }
+
+      if (inode == nnode) nnode++;
+
+      merge_profile(node + inode, &with);
+
+      free_profile(&with);
+    }
+
+    printf("# The report merges %d hosts, every host counts as a thread.\n",
+           nnode);
+
+    for (int inode = 0; inode < nnode; inode++)
+    {
+      printf("# Host %s merges %d threads.\n",
+             node[inode].profile_host[0] == '\0' ? "?" : node[inode].profile_host,
+             node[inode].nmerged);
+
+      //a host is merged as a single thread
+
+      node[inode].nmerged = 0;
+
+      merge_profile(&merged, node + inode);
+
+      free_profile(node + inode);
+    }
+
+    free(node);
+  }
+  else if (iarg == argc - 1)
+  {
+    //a single profile is reported as is
+
+    read_profile(argv[iarg], &merged);
+  }
+  else
+  {
+    for (; iarg < argc; iarg++)
+    {
+      profile_t with;
+
+      read_profile(argv[iarg], &with);
+
+      merge_profile(&merged, &with);
+
+      free_profile(&with);
+    }
+  }
+
+  report_profile(stdout, &merged, sort_key, verbose);
+
+  free_profile(&merged);
+
+  return(EXIT_SUCCESS);
+}
@@ -0,0 +1,331 @@
+//gwp-top: live view of a program compiled with -DPROFILE_SHM
+//gwp-top [-i secs] [-n lines] [-c count] pid|name
+//attaches read-only to the shared-memory segment /gwp.<pid> or name and
+//shows the calls per second and the self and total time per second of the
+//blocks of all threads, every secs seconds
+
+#include "profile_report.h"
+
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+local void usage(void)
+{
+  fprintf(stderr, "usage: gwp-top [-i secs] [-n lines] [-c count] pid|name\n");
+  exit(EXIT_FAILURE);
+}
+
+local double wall_secs(void)
+{
+  struct timespec tv;
+
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+
+  return(tv.tv_sec + tv.tv_nsec / 1000000000.0);
+}
+
+//the counters of every block in every slot at the previous refresh
+
+typedef struct
+{
+  long long top_calls;
+  double top_time_self_total;
+  double top_time_total;
+} previous_t;
+
+//the blocks of all threads, merged by name and invocation
+
+typedef struct
+{
+  const char *row_name;
+  int row_invocation;
+  int row_nthread;
+  long long row_calls;
+  double row_time_self;
+  double row_time_total;
+} row_t;
+
+local int compare_names(const void *a, const void *b)
+{
+  const row_t *row_a = a;
+  const row_t *row_b = b;
+
+  int result = strcmp(row_a->row_name, row_b->row_name);
+
+  if (result != 0) return(result);
+
+  return(row_a->row_invocation - row_b->row_invocation);
+}
+
+local int compare_self(const void *a, const void *b)
+{
+  const row_t *row_a = a;
+  const row_t *row_b = b;
+
+  if (row_a->row_time_self > row_b->row_time_self) return(-1);
+  if (row_a->row_time_self < row_b->row_time_self) return(1);
+
+  return(compare_names(a, b));
+}
+
+local shm_header_t *attach(const char *arg)
+{
+  char name[NAME_MAX];
+
+  int digits = TRUE;
+
+  for (const char *c = arg; *c != '\0'; c++)
+    if (!isdigit((unsigned char) *c)) digits = FALSE;
+
+  if (digits)
+    snprintf(name, NAME_MAX, "/gwp.%s", arg);
+  else
+    snprintf(name, NAME_MAX, "%s%s", *arg == '/' ? "" : "/", arg);
+
+  int fd = shm_open(name, O_RDONLY, 0);
+
+  if (fd == -1)
+  {
+    fprintf(stderr, "gwp-top: cannot open %s, was the program compiled "
+                    "with -DPROFILE_SHM?\n", name);
+    exit(EXIT_FAILURE);
+  }
+
+  struct stat status;
+
+  PROFILE_BUG(fstat(fd, &status) != 0)
+
+  PROFILE_BUG(status.st_size < (off_t) sizeof(shm_header_t))
+
+  shm_header_t *with;
+
+  PROFILE_BUG((with = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED,
+                           fd, 0)) == MAP_FAILED)
+
+  close(fd);
+
+  if (__atomic_load_n(&(with->shm_magic), __ATOMIC_ACQUIRE) != SHM_MAGIC)
+  {
+    fprintf(stderr, "gwp-top: %s is not initialized\n", name);
+    exit(EXIT_FAILURE);
+  }
+
+  if ((with->shm_version != SHM_VERSION) or
+      (with->shm_size_block != (int) sizeof(shm_block_t)))
+  {
+    fprintf(stderr, "gwp-top: %s has version %d, expected version %d\n",
+            name, with->shm_version, SHM_VERSION);
+    exit(EXIT_FAILURE);
+  }
+
+  PROFILE_BUG((size_t) status.st_size < SHM_SIZE(with))
+
+  return(with);
+}
+
+int main(int argc, char **argv)
+{
+  double interval = 1.0;
+  int nline = 20;
+  int count = -1;
+
+  int iarg = 1;
+
+  for (; iarg < argc; iarg++)
+  {
+    if (argv[iarg][0] != '-') break;
+
+    if (iarg + 1 >= argc) usage();
+
+    if (strcmp(argv[iarg], "-i") == 0)
+      interval = atof(argv[++iarg]);
+    else if (strcmp(argv[iarg], "-n") == 0)
+      nline = atoi(argv[++iarg]);
+    else if (strcmp(argv[iarg], "-c") == 0)
+      count = atoi(argv[++iarg]);
+    else
+      usage();
+  }
+
+  if ((iarg != argc - 1) or (interval <= 0.0) or (nline < 1)) usage();
+
+  shm_header_t *with = attach(argv[iarg]);
+
+  int nthread_max = with->shm_nthread_max;
+  int nblock_max = with->shm_nblock_max;
+
+  int *generation;
+  previous_t *previous;
+  row_t *rows;
+
+  PROFILE_BUG((generation = calloc(nthread_max, sizeof(int))) == NULL)
+  PROFILE_BUG((previous = calloc((size_t) nthread_max * nblock_max,
+                                 sizeof(previous_t))) == NULL)
+  PROFILE_BUG((rows = calloc((size_t) nthread_max * nblock_max,
+                             sizeof(row_t))) == NULL)
+
+  //names are copied, since a reused slot can overwrite them
+
+  char (*names)[NAME_MAX];
+
+  PROFILE_BUG((names = calloc((size_t) nthread_max * nblock_max,
+                              NAME_MAX)) == NULL)
+
+  int clear = isatty(STDOUT_FILENO);
+
+  double wall_previous = wall_secs();
+
+  for (int irefresh = 0; (count < 0) or (irefresh <= count); irefresh++)
+  {
+    int alive = (kill(with->shm_pid, 0) == 0) or (errno != ESRCH);
+
+    int nrow = 0;
+
+    for (int ithread = 0; ithread < nthread_max; ithread++)
+    {
+      shm_thread_t *with_thread = SHM_THREAD(with, ithread);
+
+      int shm_generation =
+        __atomic_load_n(&(with_thread->shm_generation), __ATOMIC_ACQUIRE);
+
+      if (shm_generation == 0) continue;
+
+      previous_t *with_previous = previous + (size_t) ithread * nblock_max;
+
+      //the counters of a new thread or of a reset start at zero
+
+      if (shm_generation != generation[ithread])
+      {
+        memset(with_previous, 0, nblock_max * sizeof(previous_t));
+
+        generation[ithread] = shm_generation;
+      }
+
+      int nblock = __atomic_load_n(&(with_thread->shm_nblock), __ATOMIC_ACQUIRE);
+
+      if (nblock > nblock_max) nblock = nblock_max;
+
+      for (int iblock = 0; iblock < nblock; iblock++)
+      {
+        shm_block_t *with_block = SHM_BLOCK(with_thread, iblock);
+
+        long long calls = with_block->shm_calls;
+        double time_self_total = with_block->shm_time_self_total;
+        double time_total = with_block->shm_time_total;
+
+        row_t *with_row = rows + nrow;
+
+        memcpy(names[nrow], with_block->shm_name, NAME_MAX);
+
+        names[nrow][NAME_MAX - 1] = '\0';
+
+        with_row->row_name = names[nrow];
+        with_row->row_invocation = with_block->shm_invocation;
+        with_row->row_nthread = 1;
+
+        with_row->row_calls = calls - with_previous[iblock].top_calls;
+        with_row->row_time_self = time_self_total -
+                                  with_previous[iblock].top_time_self_total;
+        with_row->row_time_total = time_total -
+                                   with_previous[iblock].top_time_total;
+
+        //a block that was reset or reused in between
+
+        if ((with_row->row_calls < 0) or (with_row->row_time_self < 0.0) or
+            (with_row->row_time_total < 0.0))
+        {
+          with_row->row_calls = calls;
+          with_row->row_time_self = time_self_total;
+          with_row->row_time_total = time_total;
+        }
+
+        with_previous[iblock].top_calls = calls;
+        with_previous[iblock].top_time_self_total = time_self_total;
+        with_previous[iblock].top_time_total = time_total;
+
+        nrow++;
+      }
+    }
+
+    double wall = wall_secs();
+
+    double secs = wall - wall_previous;
+
+    wall_previous = wall;
+
+    //the first refresh only reads the counters
+
+    if (irefresh > 0)
+    {
+      qsort(rows, nrow, sizeof(row_t), compare_names);
+
+      int nmerged = 0;
+
+      for (int irow = 0; irow < nrow; irow++)
+      {
+        if ((nmerged > 0) &&
+            (compare_names(rows + nmerged - 1, rows + irow) == 0))
+        {
+          row_t *with_merged = rows + nmerged - 1;
+
+          with_merged->row_nthread++;
+          with_merged->row_calls += rows[irow].row_calls;
+          with_merged->row_time_self += rows[irow].row_time_self;
+          with_merged->row_time_total += rows[irow].row_time_total;
+        }
+        else
+        {
+          rows[nmerged++] = rows[irow];
+        }
+      }
+
+      qsort(rows, nmerged, sizeof(row_t), compare_self);
+
+      if (clear) printf("\033[H\033[2J");
+
+      printf("# gwp-top pid %d, counter %s, %.2f secs%s\n",
+             with->shm_pid, with->shm_counter, secs,
+             alive ? "" : ", the program has exited");
+
+      printf("%-32s %10s %8s %14s %10s %10s\n",
+             "name", "invocation", "threads", "calls/sec", "self%", "total%");
+
+      for (int irow = 0; (irow < nmerged) && (irow < nline); irow++)
+      {
+        row_t *with_row = rows + irow;
+
+        printf("%-32s %10d %8d %14.1f %10.2f %10.2f\n",
+               with_row->row_name,
+               with_row->row_invocation,
+               with_row->row_nthread,
+               with_row->row_calls / secs,
+               100.0 * with_row->row_time_self / secs,
+               100.0 * with_row->row_time_total / secs);
+      }
+
+      printf("\n");
+
+      fflush(stdout);
+    }
+
+    if (!alive) break;
+
+    if ((count >= 0) && (irefresh == count)) break;
+
+    struct timespec tv;
+
+    tv.tv_sec = (time_t) interval;
+    tv.tv_nsec = (long) ((interval - tv.tv_sec) * 1000000000.0);
+
+    nanosleep(&tv, NULL);
+  }
+
+  return(EXIT_SUCCESS);
+}
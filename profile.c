@@ -1,812 +1,3781 @@
+//dladdr needs _GNU_SOURCE
+#ifdef PROFILE_FUNCTIONS
+#define _GNU_SOURCE
+#endif
+
 #include "profile.h"
 //SCU REVISION 0.589 ma 25 apr 2022  9:43:39 CEST
 
 #ifdef PROFILE
 
-#include <stdio.h>
-#include <stdlib.h>
+#include "profile_report.h"
+
 #include <string.h>
 #include <math.h>
+#include <time.h>
 #include <unistd.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#ifdef PROFILE_SNAPSHOT_SIGNAL
+#include <signal.h>
+#include <semaphore.h>
+#endif
+
+#ifdef PROFILE_FUNCTIONS
+#include <stdint.h>
+#include <dlfcn.h>
+#endif
+
+#if (PROFILE_COUNTER == PROFILE_COUNTER_TSC) || \
+    (PROFILE_COUNTER == PROFILE_COUNTER_TSCP)
+#include <cpuid.h>
+#endif
 
-#define PROFILE_BUG(X) if (X)\
-  {fprintf(stderr, "%s::%ld:%s\n", __FILE__, (long) __LINE__, #X); exit(EXIT_FAILURE);}
+#ifdef PROFILE_SHM
+#include <sys/mman.h>
+#endif
+
+#ifdef PROFILE_PERF
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
 
-#define local static
-#define FALSE 0
-#define TRUE  1
-#define or    ||
+//entries in the first chunk of the growable tables
 
-#define NAME_MAX  32
-#define BLOCK_MAX 100
-#define STACK_MAX 100
+#define STACK_CHUNK  64
+#define THREAD_CHUNK 16
+
+#define STACK(W, I) CHUNK_ENTRY((W)->stack_chunk, I, STACK_CHUNK)
 
-#define TICKS(TV) (TV.tv_sec * 1000000000 + TV.tv_nsec)
 #define SECS(X)   ((double) (X) / (double) frequency)
-#define PERC(X)   ((X) / time_self_total * 100)
 
-#define PL profile_local[pid]
+#define PL (*profile_local)
 
-//call stack
+//call stack, a frame_t since signal.h defines stack_t
 typedef struct
 {
   int stack_id;
 
-  double stack_time_self;
-  double stack_time_total;
+  //corrected ticks
+
+  long long stack_ticks_self;
+  long long stack_ticks_total;
 
   counter_t stack_counter_begin;
   counter_t stack_counter_end;
-} stack_t;
+
+#ifdef PROFILE_CCT
+  int stack_node;
+#endif
+
+#ifdef PROFILE_TRACE
+  long long stack_trace_begin;
+#endif
+
+#ifdef PROFILE_PERF
+  long long stack_perf_begin[NPERF];
+  long long stack_perf_child[NPERF];
+#endif
+
+#ifdef PROFILE_FUNCTIONS
+  void *stack_function;
+#endif
+
+#ifdef PROFILE_WALL
+  counter_t stack_stamp_begin;
+  long long stack_wall_begin;
+  long long stack_off_child;
+#endif
+
+#ifdef PROFILE_MALLOC
+  long long stack_mallocs;
+  long long stack_malloc_bytes;
+  long long stack_frees;
+  long long stack_mallocs_child;
+  long long stack_malloc_bytes_child;
+#endif
+
+#ifdef PROFILE_DEINSTRUMENT
+  //TRUE if the call is only counted since it or a caller is de-instrumented
+
+  int stack_folded;
+#endif
+} frame_t;
+
+#ifdef PROFILE_CCT
+
+//calling context tree, compile with -DPROFILE_CCT
+//node 0 is the root, every other node is a block called on the call path
+//of its parent node
 
 typedef struct
 {
-  int child_active;
-  long long child_calls;
-  double child_time_total;
-} child_t;
+  int node_block_id;
+  int node_parent;
+
+  long long node_calls;
+
+  long long node_ticks_self;
+  long long node_ticks_total;
+} node_t;
+
+#define NODE_CHUNK 64
+
+#define NODE(W, I) CHUNK_ENTRY((W)->node_chunk, I, NODE_CHUNK)
+
+#define HASH_NODE(P, B) HASH_EDGE((unsigned int) (P) * 31U + (unsigned int) (B))
+
+#endif
+
+#ifdef PROFILE_TRACE
+
+//event tracing, compile with -DPROFILE_TRACE
+//end_block appends a complete event to the ring buffer of its thread,
+//a drainer thread streams the ring buffers to profile-trace.json
+//the ring buffers have a single producer and a single consumer, so they only
+//need the ordering of the head and tail, if a ring buffer is full the event
+//is dropped
+
+#ifndef PROFILE_TRACE_RING
+#define PROFILE_TRACE_RING 65536
+#endif
+
+#if (PROFILE_TRACE_RING & (PROFILE_TRACE_RING - 1)) != 0
+#error "PROFILE_TRACE_RING should be a power of two"
+#endif
 
 typedef struct
 {
-  int parent_active;
-  long long parent_calls;
-} parent_t;
+  long long event_begin;
+  long long event_end;
+  int event_block_id;
+} event_t;
 
 typedef struct
 {
-  char block_name[NAME_MAX];
-  int block_invocation;
+  //written by the thread
+
+  long long trace_head __attribute__((aligned(PROFILE_CACHE_LINE)));
+  long long trace_ndropped;
+
+  //written by the drainer
+
+  long long trace_tail __attribute__((aligned(PROFILE_CACHE_LINE)));
+
+  event_t trace_event[PROFILE_TRACE_RING] __attribute__((aligned(PROFILE_CACHE_LINE)));
+} trace_t;
+
+//the time stamps of the events should be comparable between threads, so the
+//thread CPU time counter is replaced by the monotonic clock
+
+#if PROFILE_COUNTER == PROFILE_COUNTER_THREAD
+
+static inline long long trace_ticks(void)
+{
+  struct timespec monotonic;
+
+  clock_gettime(CLOCK_MONOTONIC, &monotonic);
+
+  return(TICKS(monotonic));
+}
+
+#define TRACE_TICKS trace_ticks()
+#define TRACE_FREQUENCY 1000000000LL
+
+#else
+
+#define TRACE_TICKS TICKS(PG.counter_stamp)
+#define TRACE_FREQUENCY frequency
+
+#endif
+
+#endif
+
+#ifdef PROFILE_WALL
+
+//off-CPU time, compile with -DPROFILE_WALL
+//begin_block and end_block also read the wall-clock time right after the
+//counter stamp, the off-CPU time of a call is its wall-clock time minus its
+//CPU time between the stamps, so the profile overhead cancels out
+
+#if PROFILE_COUNTER != PROFILE_COUNTER_THREAD
+#error "-DPROFILE_WALL needs the thread CPU time counter"
+#endif
+
+static inline long long wall_nsecs(void)
+{
+  struct timespec tv;
+
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+
+  return(tv.tv_sec * 1000000000LL + tv.tv_nsec);
+}
+
+#endif
 
-  //needed for end_block
-  int *block_invocation_pointer;
+#ifdef PROFILE_FUNCTIONS
 
-  long long block_calls;
+//a function is a site with the address of the function as the key,
+//function_site is PROFILE_INVALID if the function is excluded
 
-  double block_time_self_total;
-  double block_time_total;
+typedef struct
+{
+  void *function;
+  int function_site;
+} function_t;
 
-  long long block_child_calls;
-  double block_child_time_total;
+#define FUNCTION_CHUNK 64
 
-  parent_t block_parent[BLOCK_MAX];
-  child_t block_child[BLOCK_MAX];
+#endif
 
-  double block_time_recursive_total;
-  long long block_calls_recursive_total;
-} block_t;
+//in_use is FALSE if the thread of the slot has exited
 
 typedef struct
 {
+  int tid;
+  int in_use;
+
   int nstack;
-  stack_t stack[STACK_MAX];
+  frame_t *stack_chunk[PROFILE_CHUNK_MAX];
 
-  int nblock;
-  block_t block[BLOCK_MAX];
+  profile_t profile;
 
   counter_t counter_overhead_begin;
   counter_t counter_overhead_end;
-  double time_total;
-} profile_local_t;
 
-profile_global_t profile_global[THREAD_MAX];
+  long long ncorrection;
+  double counter_correction;
+
+#ifdef PROFILE_CCT
+  int nnode;
+  node_t *node_chunk[PROFILE_CHUNK_MAX];
+
+  //hash table of node ids keyed by parent node and block id,
+  //nnode_hash is zero or a power of two
+
+  int nnode_hash;
+  int *node_hash;
+#endif
+
+#ifdef PROFILE_TRACE
+  trace_t *trace;
+#endif
+
+#ifdef PROFILE_SAMPLE
+  unsigned int sample_random;
+#endif
+
+#ifdef PROFILE_FUNCTIONS
+  //hash table of the functions keyed by address, nfunction_hash is zero or
+  //a power of two, the state of the functions is kept in chunks that are
+  //never moved since the blocks point to it
+
+  int nfunction;
+  int nfunction_site;
+  int nfunction_hash;
+  function_t *function_hash;
+  profile_static_t *function_chunk[PROFILE_CHUNK_MAX];
+#endif
+
+#ifdef PROFILE_SHM
+  //the slot of the thread in the shared-memory segment, NULL if the
+  //segment has no slot for the thread
+
+  shm_thread_t *shm_thread;
+#endif
+
+#ifdef PROFILE_PERF
+  int perf;
+  int perf_fd[NPERF];
+  struct perf_event_mmap_page *perf_page[NPERF];
+#endif
+
+  //snapshots by other threads
+  //sequence is odd while the thread updates its profile
+  //reset_seen is the last reset applied to the profile
+  //copy is the copy of the profile made by the thread itself if it was too
+  //busy to be copied by the snapshot
+  //readers is the number of queries that pinned the slot, a thread that
+  //exits sets retiring, so that the slot is not pinned again, and waits
+  //until the readers have copied its profile
+
+  unsigned int sequence;
+  int request_seen;
+  int reset_seen;
+  int copy_state;
+  profile_t copy;
+  int readers;
+  int retiring;
+} __attribute__((aligned(PROFILE_CACHE_LINE))) profile_local_t;
+
+#define COPY_NONE      0
+#define COPY_REQUESTED 1
+#define COPY_COPYING   2
+#define COPY_DONE      3
 
-local pthread_mutex_t profile_mutex;
+__thread profile_global_t profile_global;
+
+//profile_mutex is only taken when a thread or site is registered,
+//keep it away from the read-mostly globals
+
+local pthread_mutex_t profile_mutex __attribute__((aligned(PROFILE_CACHE_LINE)));
 
 //tid = thread id
 //pid = logical thread id
 
-local int tids[THREAD_MAX];
-local profile_local_t profile_local[THREAD_MAX];
+__thread int profile_pid = PROFILE_INVALID;
+
+__thread profile_static_t *profile_static_chunk[PROFILE_CHUNK_MAX];
+
+#ifdef PROFILE_REGISTER
+__thread profile_static_t *profile_static_site = NULL;
+#endif
+
+//the profile of the calling thread
+
+local __thread profile_local_t *profile_local = NULL;
+
+#ifdef PROFILE_MALLOC
+
+//the allocations of GWP itself are not counted, the entry points of the
+//profiler count up malloc_internal of the calling thread
+
+local __thread int malloc_internal = 0;
+
+#define INTERNAL_BEGIN malloc_internal++;
+#define INTERNAL_END   malloc_internal--;
+
+#else
+
+#define INTERNAL_BEGIN
+#define INTERNAL_END
+
+#endif
+
+//the profiles of all threads indexed by pid
 
-local long long frequency;
-local counter_t counter_dummy;
+local int nthread;
+local profile_local_t *profile_local_chunk[PROFILE_CHUNK_MAX];
+
+//the profiles of the threads that have exited are merged into the profile
+//of retired_local and their slots are reused by new threads, so a program
+//that creates many short-lived threads needs a bounded number of slots
+//the destructor of profile_key retires a thread when it exits
+
+local pthread_key_t profile_key;
+
+local profile_local_t retired_local;
+
+local int nfree_pid = 0;
+local int nfree_pid_max = 0;
+local int *free_pid = NULL;
+
+local int nsite;
+
+//profile_request is incremented for every reset or copy request,
+//so end_block only has to compare it with request_seen
+
+local int profile_request __attribute__((aligned(PROFILE_CACHE_LINE))) = 0;
+local int profile_reset = 0;
+
+//only serializes the snapshots, instrumented threads never take it
+
+local pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//serializes the copies of the profiles of other threads, a thread serves
+//one copy request at a time
+//it is taken after snapshot_mutex
+
+local pthread_mutex_t copy_mutex = PTHREAD_MUTEX_INITIALIZER;
+local int nsnapshot = 0;
+
+local long long frequency __attribute__((aligned(PROFILE_CACHE_LINE)));
 
 #define NEXCEPTIONS_MAX 1024
 
 local long long counter_mean;
 local long long counter_sigma;
+local long long ncall;
 local long long ncounter_largest;
 local long long counter_largest;
 
+#ifdef PROFILE_PERF
+
+//hardware performance counters, compile with -DPROFILE_PERF
+//the counters of a thread are opened as one group, so that they count the
+//same instructions, and are read in user space with rdpmc if the kernel
+//allows it, otherwise with read
+//the counts of a block include the part of the profile overhead between
+//the reads in begin_block and end_block
+
+local struct
+{
+  unsigned int perf_type;
+  unsigned long long perf_config;
+  const char *perf_name;
+} perf_events[NPERF] =
+{
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "LLC misses"},
+  {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                       (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                       (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), "L1D misses"},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch misses"}
+};
+
+local int perf_warned = FALSE;
+
+//open the counters of the calling thread, called with profile_mutex taken
+
+local void open_perf(profile_local_t *with)
+{
+  with->perf = 0;
+
+  int leader = -1;
+
+  for (int iperf = 0; iperf < NPERF; iperf++)
+  {
+    with->perf_fd[iperf] = -1;
+    with->perf_page[iperf] = NULL;
+
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+
+    attr.size = sizeof(attr);
+    attr.type = perf_events[iperf].perf_type;
+    attr.config = perf_events[iperf].perf_config;
+    attr.disabled = (leader == -1);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+
+    if (fd == -1) continue;
+
+    if (leader == -1) leader = fd;
+
+    with->perf_fd[iperf] = fd;
+
+    with->perf |= 1 << iperf;
+
+    void *page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+
+    if (page != MAP_FAILED) with->perf_page[iperf] = page;
+  }
+
+  if (!perf_warned)
+  {
+    if (with->perf == 0)
+      fprintf(stderr, "profile: cannot open the hardware counters, "
+                      "check /proc/sys/kernel/perf_event_paranoid\n");
+    else
+      for (int iperf = 0; iperf < NPERF; iperf++)
+        if ((with->perf & (1 << iperf)) == 0)
+          fprintf(stderr, "profile: cannot count the %s\n",
+            perf_events[iperf].perf_name);
+
+    perf_warned = TRUE;
+  }
+
+  if (leader != -1)
+    PROFILE_BUG(ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) == -1)
+}
+
+//close the counters of a thread that exits
+
+local void close_perf(profile_local_t *with)
+{
+  for (int iperf = 0; iperf < NPERF; iperf++)
+  {
+    if (with->perf_page[iperf] != NULL)
+      (void) munmap(with->perf_page[iperf], sysconf(_SC_PAGESIZE));
+
+    if (with->perf_fd[iperf] != -1) (void) close(with->perf_fd[iperf]);
+
+    with->perf_fd[iperf] = -1;
+    with->perf_page[iperf] = NULL;
+  }
+
+  with->perf = 0;
+}
+
+local long long read_counter(profile_local_t *with, int iperf)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  struct perf_event_mmap_page *page = with->perf_page[iperf];
+
+  if (page != NULL)
+  {
+    unsigned int lock;
+    unsigned int index;
+    long long count;
+
+    //the kernel updates the page when the thread is scheduled
+
+    do
+    {
+      lock = __atomic_load_n(&(page->lock), __ATOMIC_ACQUIRE);
+
+      index = page->index;
+
+      count = page->offset;
+
+      if (page->cap_user_rdpmc && (index != 0))
+      {
+        int shift = 64 - page->pmc_width;
+
+        count += (long long) (__rdpmc(index - 1) << shift) >> shift;
+      }
+
+      __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    }
+    while(__atomic_load_n(&(page->lock), __ATOMIC_RELAXED) != lock);
+
+    if (page->cap_user_rdpmc && (index != 0)) return(count);
+  }
+#endif
+
+  long long count;
+
+  if (read(with->perf_fd[iperf], &count, sizeof(count)) != sizeof(count))
+    count = 0;
+
+  return(count);
+}
+
+local void read_perf(profile_local_t *with, long long *perf)
+{
+  for (int iperf = 0; iperf < NPERF; iperf++)
+    perf[iperf] = (with->perf & (1 << iperf)) ? read_counter(with, iperf) : 0;
+}
+
+#endif
+
+#ifdef PROFILE_REGISTER
+local profile_static_t *new_static_site(void);
+#endif
+
+#ifdef PROFILE_SHM
+local shm_thread_t *return_shm_thread(int);
+#endif
+
+//the slot of a thread that has exited is reused, snapshot_mutex keeps
+//snapshots from copying the slot while it is initialized
+
 int return_pid(int tid)
 {
-  int result;
+  INTERNAL_BEGIN
+
+  pthread_mutex_lock(&snapshot_mutex);
 
   pthread_mutex_lock(&profile_mutex);
 
-  for (result = 0; result < THREAD_MAX; result++)
-    if (tids[result] == tid) break;
+  int result;
 
-  if (result >= THREAD_MAX)
+  if (nfree_pid > 0)
+    result = free_pid[--nfree_pid];
+  else
   {
-    for (result = 0; result < THREAD_MAX; result++)
-      if (tids[result] == PROFILE_INVALID) break;
+    result = nthread++;
+
+    int ichunk = PROFILE_CHUNK(result, THREAD_CHUNK);
+
+    if (profile_local_chunk[ichunk] == NULL)
+      profile_local_chunk[ichunk] =
+        new_chunk(ichunk, THREAD_CHUNK, sizeof(profile_local_t));
+  }
+
+  profile_local_t *with = CHUNK_ENTRY(profile_local_chunk, result, THREAD_CHUNK);
+
+  with->tid = tid;
+
+  with->in_use = TRUE;
+
+  with->retiring = FALSE;
+
+  with->nstack = 0;
+
+  memset(&(with->profile), 0, sizeof(profile_t));
+
+  with->profile.retain_edges = TRUE;
+
+  with->sequence = 0;
+
+  with->request_seen = __atomic_load_n(&profile_request, __ATOMIC_ACQUIRE);
+
+  with->reset_seen = __atomic_load_n(&profile_reset, __ATOMIC_ACQUIRE);
+
+  with->copy_state = COPY_NONE;
+
+  with->ncorrection = 0;
+
+  with->counter_correction = counter_mean;
+
+#ifdef PROFILE_CCT
+  with->nnode = 0;
+
+  for (int ihash = 0; ihash < with->nnode_hash; ihash++)
+    with->node_hash[ihash] = PROFILE_INVALID;
+#endif
+
+#ifdef PROFILE_TRACE
+  //the drainer can read the ring buffer of a reused slot at any time,
+  //so it is kept
+
+  if (with->trace == NULL) with->trace = new_chunk(0, 1, sizeof(trace_t));
+#endif
+
+#ifdef PROFILE_PERF
+  open_perf(with);
+#endif
+
+#ifdef PROFILE_SAMPLE
+  with->sample_random = 2654435761U * (result + 1);
+#endif
+
+#ifdef PROFILE_SHM
+  with->shm_thread = return_shm_thread(result);
+#endif
+
+  pthread_mutex_unlock(&profile_mutex);
+
+  pthread_mutex_unlock(&snapshot_mutex);
+
+  PROFILE_BUG(pthread_setspecific(profile_key, with) != 0)
+
+  profile_local = with;
+
+  profile_pid = result;
+
+#ifdef PROFILE_REGISTER
+  profile_static_site = new_static_site();
+#endif
+
+  INTERNAL_END
+
+  return(result);
+}
+
+//assign the next site id to a BEGIN_BLOCK site
+
+void new_site(int *site)
+{
+  pthread_mutex_lock(&profile_mutex);
+
+  if (__atomic_load_n(site, __ATOMIC_ACQUIRE) == PROFILE_INVALID)
+    __atomic_store_n(site, nsite++, __ATOMIC_RELEASE);
+
+  pthread_mutex_unlock(&profile_mutex);
+}
+
+//the first recursive invocation is 1, until the first block of a site
+//is created block_id points to invalid_block_id
 
-    PROFILE_BUG(result >= THREAD_MAX)
+local int invalid_block_id[2] = {PROFILE_INVALID, PROFILE_INVALID};
 
-    tids[result] = tid;
+local void clear_static(profile_static_t *chunk, int nsite_chunk)
+{
+  for (int isite = 0; isite < nsite_chunk; isite++)
+  {
+    chunk[isite].block_id = invalid_block_id;
+    chunk[isite].nblock_id = 0;
+    chunk[isite].block_invocation = 0;
+#ifdef PROFILE_SAMPLE
+    chunk[isite].block_sample = 0;
+#endif
   }
+}
+
+profile_static_t *new_static_chunk(int ichunk)
+{
+  INTERNAL_BEGIN
+
+  profile_static_t *chunk =
+    new_chunk(ichunk, PROFILE_STATIC_CHUNK, sizeof(profile_static_t));
+
+  clear_static(chunk, PROFILE_STATIC_CHUNK << ichunk);
+
+  profile_static_chunk[ichunk] = chunk;
+
+  INTERNAL_END
+
+  return(chunk);
+}
+
+#ifdef PROFILE_REGISTER
+
+//the names of the sites registered by register_site, their ids follow
+//the ids of the sites in the section gwp_sites
+//static initialization can run before init_profile, so register_mutex
+//is initialized statically
+
+local pthread_mutex_t register_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+local int nsite_registered = 0;
+local const char **site_registered = NULL;
+
+//the sites registered after init_profile, for example by a library that is
+//loaded with dlopen, get one of the PROFILE_REGISTER_LATE spare sites of
+//every thread, the sites that do not fit share the last spare site
+
+#ifndef PROFILE_REGISTER_LATE
+#define PROFILE_REGISTER_LATE 256
+#endif
+
+#define SITE_LATE_NAME "registered-late"
+
+local int nsite_late = 0;
+local int late_warned = FALSE;
+
+//the names of all sites and the number of sites of a thread including the
+//spare sites, set by init_profile
+
+local const char **site_names = NULL;
+local int nsite_all = 0;
+
+int register_site(const char *name)
+{
+  INTERNAL_BEGIN
+
+  pthread_mutex_lock(&register_mutex);
+
+  int result;
+
+  if (site_names == NULL)
+  {
+    PROFILE_BUG((site_registered = realloc(site_registered,
+      (nsite_registered + 1) * sizeof(const char *))) == NULL)
+
+    site_registered[nsite_registered] = name;
+
+    result = PROFILE_NSITE + nsite_registered++;
+  }
+  else if (nsite_late < PROFILE_REGISTER_LATE - 1)
+  {
+    result = nsite_all - PROFILE_REGISTER_LATE + nsite_late++;
+
+    __atomic_store_n(site_names + result, name, __ATOMIC_RELEASE);
+  }
+  else
+  {
+    if (!late_warned)
+      fprintf(stderr, "profile: more than %d sites were registered after "
+                      "INIT_PROFILE, the others share the block %s\n",
+                      PROFILE_REGISTER_LATE - 1, SITE_LATE_NAME);
+
+    late_warned = TRUE;
+
+    result = nsite_all - 1;
+  }
+
+  pthread_mutex_unlock(&register_mutex);
+
+  INTERNAL_END
+
+  return(result);
+}
+
+local profile_static_t *new_static_site(void)
+{
+  profile_static_t *result;
+
+  PROFILE_BUG((result = malloc((nsite_all + 1) * sizeof(profile_static_t))) == NULL)
+
+  clear_static(result, nsite_all);
+
+  return(result);
+}
+
+#endif
+
+#define NBLOCK_ID_MIN 8
+
+//the thread updates its profile between write_begin and write_end
+
+local void write_begin(profile_local_t *with)
+{
+  __atomic_store_n(&(with->sequence), with->sequence + 1, __ATOMIC_RELAXED);
+
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+local void write_end(profile_local_t *with)
+{
+  __atomic_store_n(&(with->sequence), with->sequence + 1, __ATOMIC_RELEASE);
+}
+
+#ifdef PROFILE_SHM
+
+//live export, compile with -DPROFILE_SHM
+//init_profile creates the shared-memory segment /gwp.<pid>, or GWP_SHM,
+//with GWP_SHM_THREADS slots of GWP_SHM_BLOCKS blocks, end_block and
+//skip_block store the counters of the block in the slot of the thread
+//the blocks and threads that do not fit are not exported
+
+#define SHM_NTHREAD_MAX 64
+#define SHM_NBLOCK_MAX  1024
+
+local char shm_name[NAME_MAX];
+
+local shm_header_t *shm_header = NULL;
+
+#ifdef PROFILE_FUNCTIONS
+local const char *resolve_name(void *);
+#endif
+
+local int return_shm_limit(const char *name, int limit)
+{
+  const char *value = getenv(name);
+
+  if (value == NULL) return(limit);
+
+  int result = atoi(value);
+
+  PROFILE_BUG(result < 1)
+
+  return(result);
+}
+
+local void unlink_shm(void)
+{
+  (void) shm_unlink(shm_name);
+}
+
+local void create_shm(void)
+{
+  const char *name = getenv("GWP_SHM");
+
+  if (name != NULL)
+    snprintf(shm_name, NAME_MAX, "%s%s", *name == '/' ? "" : "/", name);
+  else
+    snprintf(shm_name, NAME_MAX, "/gwp.%d", (int) getpid());
+
+  shm_header_t header;
+
+  header.shm_nthread_max = return_shm_limit("GWP_SHM_THREADS", SHM_NTHREAD_MAX);
+  header.shm_nblock_max = return_shm_limit("GWP_SHM_BLOCKS", SHM_NBLOCK_MAX);
+
+  int fd;
+
+  PROFILE_BUG((fd = shm_open(shm_name, O_CREAT | O_TRUNC | O_RDWR, 0644)) == -1)
+
+  PROFILE_BUG(ftruncate(fd, SHM_SIZE(&header)) != 0)
+
+  PROFILE_BUG((shm_header = mmap(NULL, SHM_SIZE(&header),
+                                 PROT_READ | PROT_WRITE, MAP_SHARED,
+                                 fd, 0)) == MAP_FAILED)
+
+  close(fd);
+
+  shm_header->shm_version = SHM_VERSION;
+  shm_header->shm_size_block = sizeof(shm_block_t);
+  shm_header->shm_nthread_max = header.shm_nthread_max;
+  shm_header->shm_nblock_max = header.shm_nblock_max;
+  shm_header->shm_pid = getpid();
+
+  snprintf(shm_header->shm_counter, NAME_MAX, "%s", PROFILE_COUNTER_NAME);
+
+  __atomic_store_n(&(shm_header->shm_magic), SHM_MAGIC, __ATOMIC_RELEASE);
+
+  PROFILE_BUG(atexit(unlink_shm) != 0)
+}
+
+//called by return_pid when the slot of a thread is (re)used
+
+local shm_thread_t *return_shm_thread(int pid)
+{
+  if ((shm_header == NULL) or (pid >= shm_header->shm_nthread_max))
+    return(NULL);
+
+  shm_thread_t *with_thread = SHM_THREAD(shm_header, pid);
+
+  __atomic_store_n(&(with_thread->shm_nblock), 0, __ATOMIC_RELEASE);
+
+  __atomic_add_fetch(&(with_thread->shm_generation), 1, __ATOMIC_RELEASE);
+
+  return(with_thread);
+}
+
+local void export_name(int block_id, block_t *with_block)
+{
+  shm_thread_t *with_thread = PL.shm_thread;
+
+  if ((with_thread == NULL) or (block_id >= shm_header->shm_nblock_max))
+    return;
+
+  shm_block_t *with_shm = SHM_BLOCK(with_thread, block_id);
+
+  const char *name = with_block->block_name;
+
+#ifdef PROFILE_FUNCTIONS
+  if (with_block->block_address != NULL)
+    name = resolve_name(with_block->block_address);
+#endif
+
+  format_name(with_shm->shm_name, name);
+
+  with_shm->shm_invocation = with_block->block_invocation;
+  with_shm->shm_calls = 0;
+  with_shm->shm_time_self_total = 0.0;
+  with_shm->shm_time_total = 0.0;
+
+  __atomic_store_n(&(with_thread->shm_nblock), block_id + 1, __ATOMIC_RELEASE);
+}
+
+//plain stores, the reader only wants rates
+
+static inline void export_block(int block_id, block_t *with_block)
+{
+  shm_thread_t *with_thread = PL.shm_thread;
+
+  if ((with_thread == NULL) or (block_id >= shm_header->shm_nblock_max))
+    return;
+
+  shm_block_t *with_shm = SHM_BLOCK(with_thread, block_id);
+
+  with_shm->shm_calls = with_block->block_calls;
+  with_shm->shm_time_self_total = with_block->block_time_self_total;
+  with_shm->shm_time_total = with_block->block_time_total;
+}
+
+//a reset clears the exported counters of the thread
+
+local void reset_shm(void)
+{
+  shm_thread_t *with_thread = PL.shm_thread;
+
+  if (with_thread == NULL) return;
+
+  for (int iblock = 0; iblock < PL.profile.nblock; iblock++)
+    export_block(iblock, BLOCK(&(PL.profile), iblock));
+
+  __atomic_add_fetch(&(with_thread->shm_generation), 1, __ATOMIC_RELEASE);
+}
+
+#endif
+
+//add the block of the current invocation of a site to the profile of the
+//calling thread, block_name is the string literal of the site, it is only
+//shortened when it is reported
+
+local void add_site_block(const char *block_name, void *block_address,
+  profile_static_t *with_static)
+{
+  INTERNAL_BEGIN
+
+#ifdef PROFILE_FLAT_RECURSION
+  int invocation = 1;
+#else
+  int invocation = with_static->block_invocation;
+#endif
+
+  write_begin(&PL);
+
+  int block_id = add_block(&(PL.profile));
+
+  block_t *with_block = BLOCK(&(PL.profile), block_id);
+
+  with_block->block_name = block_name;
+
+  with_block->block_invocation = invocation;
+
+  with_block->block_address = block_address;
+
+  write_end(&PL);
+
+#ifdef PROFILE_SHM
+  export_name(block_id, with_block);
+#endif
+
+  with_block->block_invocation_pointer = &(with_static->block_invocation);
+
+#ifdef PROFILE_DEINSTRUMENT
+  with_block->block_sample_pointer = &(with_static->block_sample);
+#endif
+
+  //keep room for the next invocation
+
+  if (invocation + 2 > with_static->nblock_id)
+  {
+    int nblock_id = 2 * with_static->nblock_id;
+
+    if (nblock_id < invocation + 2) nblock_id = invocation + 2;
+    if (nblock_id < NBLOCK_ID_MIN) nblock_id = NBLOCK_ID_MIN;
+
+    int *block_id_pointer;
+
+    if (with_static->nblock_id == 0)
+      block_id_pointer = malloc(nblock_id * sizeof(int));
+    else
+      block_id_pointer = realloc(with_static->block_id, nblock_id * sizeof(int));
+
+    PROFILE_BUG(block_id_pointer == NULL)
+
+    for (int iblock_id = with_static->nblock_id; iblock_id < nblock_id;
+         iblock_id++)
+      block_id_pointer[iblock_id] = PROFILE_INVALID;
+
+    with_static->block_id = block_id_pointer;
+
+    with_static->nblock_id = nblock_id;
+  }
+
+  with_static->block_id[invocation] = block_id;
+
+  INTERNAL_END
+}
+
+void new_block(int pid, const char *name, profile_static_t *with_static)
+{
+  (void) pid;
+
+  add_site_block(name, NULL, with_static);
+}
+
+#ifdef PROFILE_REGISTER
+
+void new_site_block(int pid, int site, profile_static_t *with_static)
+{
+  (void) pid;
+
+  add_site_block(__atomic_load_n(site_names + site, __ATOMIC_ACQUIRE), NULL,
+                 with_static);
+}
+
+#endif
+
+local void update_mean_sigma(long long n, long long x,
+  double *mn, double *sn)
+{
+  double mnm1 = *mn;
+  double snm1 = *sn;
+
+  *mn = mnm1 + (x - mnm1) / n;
+  
+  *sn = snm1 + (x - mnm1) * (x - *mn);
+}
+
+#define NCALIBRATION 2
+
+#ifndef PROFILE_REFRESH
+#define PROFILE_REFRESH 0
+#endif
+
+#if !defined(PROFILE_FIXED_CORRECTION) || (PROFILE_REFRESH > 0)
+
+//sample the intrinsic profile overhead NCALIBRATION times
+
+local double sample_counter_overhead(void)
+{
+  PG.counter_pointer = &(PG.counter_dummy);
+
+  double mn = 0.0;
+  double sn = 0.0;
+
+  for (long long n = 1; n <= NCALIBRATION; ++n)
+  {
+    counter_t counter_stamp;
+  
+    GET_COUNTER(&counter_stamp);
+    GET_COUNTER(PG.counter_pointer);
+  
+    update_mean_sigma(n, TICKS(PG.counter_dummy) - TICKS(counter_stamp), &mn, &sn);
+  }
+
+  return(mn);
+}
+
+#endif
+
+#ifdef PROFILE_FIXED_CORRECTION
+
+//subtract the intrinsic profile overhead measured by init_profile
+//instead of sampling it on every call
+//with PROFILE_REFRESH > 0 the correction is refreshed every PROFILE_REFRESH
+//calls with a moving average of new samples
+
+#define REFRESH_WEIGHT 16
+
+local long long counter_correction(long long counter_delta)
+{
+#if PROFILE_REFRESH > 0
+  if (++(PL.ncorrection) >= PROFILE_REFRESH)
+  {
+    PL.ncorrection = 0;
+
+    PL.counter_correction += (sample_counter_overhead() -
+                              PL.counter_correction) / REFRESH_WEIGHT;
+  }
+
+  long long result = counter_delta - llround(PL.counter_correction);
+#else
+  long long result = counter_delta - counter_mean;
+#endif
+
+  if (result < 0) result = 0;
+
+  return(result);
+}
+
+#else
+
+local long long counter_correction(long long counter_delta)
+{
+  long long result = round(sample_counter_overhead());
+
+  result = counter_delta - result;
+
+  if (result < 0) result = 0;
+
+  return(result);
+}
+
+#endif
+
+#ifdef PROFILE_CCT
+
+local int add_node(profile_local_t *with, int parent, int block_id)
+{
+  int node = with->nnode;
+
+  int ichunk = PROFILE_CHUNK(node, NODE_CHUNK);
+
+  if (with->node_chunk[ichunk] == NULL)
+    with->node_chunk[ichunk] = new_chunk(ichunk, NODE_CHUNK, sizeof(node_t));
+
+  node_t *with_node = NODE(with, node);
+
+  with_node->node_block_id = block_id;
+  with_node->node_parent = parent;
+  with_node->node_calls = 0;
+  with_node->node_ticks_self = 0;
+  with_node->node_ticks_total = 0;
+
+  with->nnode++;
+
+  return(node);
+}
+
+local void grow_nodes(profile_local_t *with)
+{
+  free(with->node_hash);
+
+  with->nnode_hash = (with->nnode_hash == 0) ? NODE_CHUNK : 2 * with->nnode_hash;
+
+  PROFILE_BUG((with->node_hash = malloc(with->nnode_hash * sizeof(int))) == NULL)
+
+  for (int ihash = 0; ihash < with->nnode_hash; ihash++)
+    with->node_hash[ihash] = PROFILE_INVALID;
+
+  unsigned int mask = with->nnode_hash - 1;
+
+  for (int node = 1; node < with->nnode; node++)
+  {
+    node_t *with_node = NODE(with, node);
+
+    unsigned int ihash =
+      HASH_NODE(with_node->node_parent, with_node->node_block_id) & mask;
+
+    while(with->node_hash[ihash] != PROFILE_INVALID)
+      ihash = (ihash + 1) & mask;
+
+    with->node_hash[ihash] = node;
+  }
+}
+
+//return the node of block_id called from parent, create it if it does not
+//exist yet
+
+local int return_node(profile_local_t *with, int parent, int block_id)
+{
+  if (with->nnode == 0) (void) add_node(with, PROFILE_INVALID, PROFILE_INVALID);
+
+  //keep the load factor below one half
+
+  if (2 * with->nnode >= with->nnode_hash) grow_nodes(with);
+
+  unsigned int mask = with->nnode_hash - 1;
+  unsigned int ihash = HASH_NODE(parent, block_id) & mask;
+
+  while(with->node_hash[ihash] != PROFILE_INVALID)
+  {
+    node_t *with_node = NODE(with, with->node_hash[ihash]);
+
+    if ((with_node->node_parent == parent) &&
+        (with_node->node_block_id == block_id))
+      return(with->node_hash[ihash]);
+
+    ihash = (ihash + 1) & mask;
+  }
+
+  with->node_hash[ihash] = add_node(with, parent, block_id);
+
+  return(with->node_hash[ihash]);
+}
+
+#endif
+
+#ifdef PROFILE_FLAT_RECURSION
+
+//the totals of a recursive call are already in the totals of the outermost
+//call and the calls of a block to itself are not edges, the calls are
+//counted per power of two of the recursion depth
+
+#define OUTERMOST(B)      (*(B)->block_invocation_pointer == 1)
+#define RECORD_EDGE(I, J) ((I) != (J))
+
+local void count_depth(block_t *with_block)
+{
+  int log2 = 31 - __builtin_clz(*with_block->block_invocation_pointer);
+
+  with_block->block_depth_calls[log2 < NDEPTH ? log2 : NDEPTH - 1]++;
+}
+
+#else
+
+#define OUTERMOST(B)      TRUE
+#define RECORD_EDGE(I, J) TRUE
+
+#endif
+
+#ifdef PROFILE_DEINSTRUMENT
+
+//the count down of the sample of a de-instrumented site, the site is timed
+//again after a reset
+
+#define DEINSTRUMENT_SAMPLE (1 << 30)
+
+#define DEINSTRUMENTED(B) ((B)->block_deinstrumented)
+
+//switch the site of a block to counts only if the mean total time of its
+//timed calls is less than PROFILE_DEINSTRUMENT times the intrinsic profile
+//overhead, called by end_block
+
+local void deinstrument(block_t *with_block)
+{
+  if (!with_block->block_deinstrumented &&
+      (with_block->block_calls_sampled >= PROFILE_DEINSTRUMENT_CALLS) &&
+      (with_block->block_time_total_sampled * frequency <
+       (double) PROFILE_DEINSTRUMENT * counter_mean *
+       with_block->block_calls_sampled))
+    with_block->block_deinstrumented = TRUE;
+
+  if (with_block->block_deinstrumented)
+    *(with_block->block_sample_pointer) = DEINSTRUMENT_SAMPLE;
+}
+
+//the time of a call of a de-instrumented block, including the time of the
+//blocks it calls, stays in the self time of its caller, so the calls below
+//it are only counted too, called by skip_block
+
+#define FOLDED(B) (DEINSTRUMENTED(B) ||\
+  ((PG.unsampled > 0) && STACK(&PL, PL.nstack - 1)->stack_folded))
+
+#else
+
+#define DEINSTRUMENTED(B) FALSE
+#define FOLDED(B)         FALSE
+
+#endif
+
+#ifdef PROFILE_MALLOC
+
+//allocation accounting, compile with -DPROFILE_MALLOC
+//malloc, calloc, realloc, free, aligned_alloc, posix_memalign and memalign
+//are interposed and forwarded to glibc, the allocations are counted in the
+//frame of the block on top of the stack and added to the block when the
+//block ends
+//operator new and delete, including the aligned versions, call these
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void *__libc_memalign(size_t, size_t);
+extern void __libc_free(void *);
+
+static inline void count_malloc(size_t size)
+{
+  if ((profile_local == NULL) or (PL.nstack == 0) or (malloc_internal > 0))
+    return;
+
+  frame_t *with_current = STACK(&PL, PL.nstack - 1);
+
+  with_current->stack_mallocs++;
+
+  with_current->stack_malloc_bytes += size;
+}
+
+void *malloc(size_t size)
+{
+  count_malloc(size);
+
+  return(__libc_malloc(size));
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  size_t nbytes;
+
+  //glibc fails the call if the size overflows
+
+  if (!__builtin_mul_overflow(nmemb, size, &nbytes)) count_malloc(nbytes);
+
+  return(__libc_calloc(nmemb, size));
+}
+
+void *realloc(void *pointer, size_t size)
+{
+  count_malloc(size);
+
+  return(__libc_realloc(pointer, size));
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+  count_malloc(size);
+
+  return(__libc_memalign(alignment, size));
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+  count_malloc(size);
+
+  return(__libc_memalign(alignment, size));
+}
+
+int posix_memalign(void **pointer, size_t alignment, size_t size)
+{
+  if ((alignment % sizeof(void *) != 0) or
+      ((alignment & (alignment - 1)) != 0) or (alignment == 0))
+    return(EINVAL);
+
+  void *result = __libc_memalign(alignment, size);
+
+  if (result == NULL) return(ENOMEM);
+
+  count_malloc(size);
+
+  *pointer = result;
+
+  return(0);
+}
+
+void free(void *pointer)
+{
+  if ((pointer != NULL) && (profile_local != NULL) && (PL.nstack > 0) &&
+      (malloc_internal == 0))
+    STACK(&PL, PL.nstack - 1)->stack_frees++;
+
+  __libc_free(pointer);
+}
+
+local void clear_malloc(frame_t *with_current)
+{
+  with_current->stack_mallocs = 0;
+  with_current->stack_malloc_bytes = 0;
+  with_current->stack_frees = 0;
+  with_current->stack_mallocs_child = 0;
+  with_current->stack_malloc_bytes_child = 0;
+}
+
+//add the allocations of the call that ended to its block and to its parent,
+//called between write_begin and write_end
+
+local void end_malloc(block_t *with_block, frame_t *with_current)
+{
+  long long mallocs_total = with_current->stack_mallocs +
+                            with_current->stack_mallocs_child;
+  long long malloc_bytes_total = with_current->stack_malloc_bytes +
+                                 with_current->stack_malloc_bytes_child;
+
+  with_block->block_mallocs_self += with_current->stack_mallocs;
+  with_block->block_malloc_bytes_self += with_current->stack_malloc_bytes;
+  with_block->block_frees_self += with_current->stack_frees;
+  if (OUTERMOST(with_block))
+  {
+    with_block->block_mallocs_total += mallocs_total;
+    with_block->block_malloc_bytes_total += malloc_bytes_total;
+  }
+
+  if (PL.nstack > 0)
+  {
+    frame_t *with_previous = STACK(&PL, PL.nstack - 1);
+
+    with_previous->stack_mallocs_child += mallocs_total;
+    with_previous->stack_malloc_bytes_child += malloc_bytes_total;
+  }
+}
+
+#endif
+
+void begin_block(int pid, int block_id)
+{
+  (void) pid;
+
+  INTERNAL_BEGIN
+
+#ifdef PROFILE_WALL
+  long long wall_begin = wall_nsecs();
+#endif
+
+  if (PL.nstack > 0)
+  {
+    frame_t *with_previous = STACK(&PL, PL.nstack - 1);
+
+    with_previous->stack_counter_end = PG.counter_stamp;
+
+    long long counter_delta = TICKS(with_previous->stack_counter_end) -
+                              TICKS(with_previous->stack_counter_begin);
+
+    with_previous->stack_ticks_self += counter_correction(counter_delta);
+  }
+  else
+  {
+    GET_COUNTER(&(PL.counter_overhead_begin));
+  }
+  int ichunk = PROFILE_CHUNK(PL.nstack, STACK_CHUNK);
+
+  if (PL.stack_chunk[ichunk] == NULL)
+    PL.stack_chunk[ichunk] = new_chunk(ichunk, STACK_CHUNK, sizeof(frame_t));
+
+  frame_t *with_current = STACK(&PL, PL.nstack);
+
+  with_current->stack_id = block_id;
+
+  with_current->stack_ticks_self = 0;
+
+  with_current->stack_ticks_total = 0;
+
+#ifdef PROFILE_TRACE
+  with_current->stack_trace_begin = TRACE_TICKS;
+#endif
+
+#ifdef PROFILE_CCT
+  with_current->stack_node =
+    return_node(&PL, PL.nstack > 0 ? STACK(&PL, PL.nstack - 1)->stack_node : 0,
+                block_id);
+#endif
+
+#ifdef PROFILE_PERF
+  for (int iperf = 0; iperf < NPERF; iperf++)
+    with_current->stack_perf_child[iperf] = 0;
+
+  read_perf(&PL, with_current->stack_perf_begin);
+#endif
+
+#ifdef PROFILE_FUNCTIONS
+  with_current->stack_function = NULL;
+#endif
+
+#ifdef PROFILE_WALL
+  with_current->stack_stamp_begin = PG.counter_stamp;
+  with_current->stack_wall_begin = wall_begin;
+  with_current->stack_off_child = 0;
+#endif
+
+#ifdef PROFILE_MALLOC
+  clear_malloc(with_current);
+#endif
+
+  PG.counter_pointer = &(with_current->stack_counter_begin);
+
+  PL.nstack++;
+
+  INTERNAL_END
+}
+
+local void serve_request(void);
+
+void end_block(int pid)
+{
+  (void) pid;
+
+  INTERNAL_BEGIN
+
+#ifdef PROFILE_WALL
+  long long wall_end = wall_nsecs();
+#endif
+
+  if (__atomic_load_n(&profile_request, __ATOMIC_RELAXED) != PL.request_seen)
+    serve_request();
+
+  PL.nstack--;
+
+  PROFILE_BUG(PL.nstack < 0)
+
+  frame_t *with_current = STACK(&PL, PL.nstack);
+
+#ifdef PROFILE_PERF
+  long long perf[NPERF];
+
+  read_perf(&PL, perf);
+#endif
+
+  with_current->stack_counter_end = PG.counter_stamp;
+
+  long long counter_delta = TICKS(with_current->stack_counter_end) -
+                            TICKS(with_current->stack_counter_begin);
+
+  with_current->stack_ticks_self += counter_correction(counter_delta);
+
+#ifdef PROFILE_SAMPLE
+  //the estimates of the calls that are not sampled were subtracted and can
+  //exceed the measured time
+
+  if (with_current->stack_ticks_self < 0) with_current->stack_ticks_self = 0;
+#endif
+
+  with_current->stack_ticks_total += with_current->stack_ticks_self;
+
+  double time_total = SECS(with_current->stack_ticks_total);
+
+#ifdef PROFILE_WALL
+  long long off_total = (wall_end - with_current->stack_wall_begin) -
+                        (TICKS(PG.counter_stamp) -
+                         TICKS(with_current->stack_stamp_begin));
+
+  double time_off_total = (double) off_total / 1000000000.0;
+#endif
+
+  write_begin(&PL);
+
+  block_t *with_block = BLOCK(&(PL.profile), with_current->stack_id);
+
+  int outermost = OUTERMOST(with_block);
+
+  with_block->block_calls++;
+
+  with_block->block_time_self_total += SECS(with_current->stack_ticks_self);
+
+  if (outermost) with_block->block_time_total += time_total;
+
+#ifdef PROFILE_FLAT_RECURSION
+  count_depth(with_block);
+#endif
+
+#ifdef PROFILE_SHM
+  export_block(with_current->stack_id, with_block);
+#endif
+
+#ifdef PROFILE_SAMPLE
+  with_block->block_calls_sampled++;
+
+  with_block->block_time_self_sampled += SECS(with_current->stack_ticks_self);
+
+  with_block->block_time_total_sampled += time_total;
+
+#ifdef PROFILE_FLAT_RECURSION
+  if (outermost)
+  {
+    with_block->block_calls_outermost_sampled++;
+
+    with_block->block_time_outermost_sampled += time_total;
+  }
+#endif
+
+#ifdef PROFILE_DEINSTRUMENT
+  deinstrument(with_block);
+#endif
+#endif
+
+  update_histogram(with_block->block_self_histogram,
+                   with_current->stack_ticks_self);
+
+  if (outermost)
+    update_histogram(with_block->block_total_histogram,
+                     with_current->stack_ticks_total);
+
+#ifdef PROFILE_PERF
+  for (int iperf = 0; iperf < NPERF; iperf++)
+  {
+    long long perf_total = perf[iperf] - with_current->stack_perf_begin[iperf];
+
+    if (outermost) with_block->block_perf_total[iperf] += perf_total;
+
+    with_block->block_perf_self[iperf] +=
+      perf_total - with_current->stack_perf_child[iperf];
+
+    if (PL.nstack > 0)
+      STACK(&PL, PL.nstack - 1)->stack_perf_child[iperf] += perf_total;
+  }
+#endif
+
+#ifdef PROFILE_MALLOC
+  end_malloc(with_block, with_current);
+#endif
+
+#ifdef PROFILE_WALL
+  if (outermost) with_block->block_time_off_total += time_off_total;
+
+  with_block->block_time_off_self +=
+    (double) (off_total - with_current->stack_off_child) / 1000000000.0;
+
+  if (PL.nstack > 0) STACK(&PL, PL.nstack - 1)->stack_off_child += off_total;
+#endif
+
+#ifdef PROFILE_TRACE
+  {
+    trace_t *with_trace = PL.trace;
+
+    long long head = with_trace->trace_head;
+
+    if ((head - __atomic_load_n(&(with_trace->trace_tail), __ATOMIC_ACQUIRE)) <
+        PROFILE_TRACE_RING)
+    {
+      event_t *with_event = with_trace->trace_event +
+                            (head & (PROFILE_TRACE_RING - 1));
+
+      with_event->event_begin = with_current->stack_trace_begin;
+      with_event->event_end = TRACE_TICKS;
+      with_event->event_block_id = with_current->stack_id;
+
+      __atomic_store_n(&(with_trace->trace_head), head + 1, __ATOMIC_RELEASE);
+    }
+    else
+    {
+      with_trace->trace_ndropped++;
+    }
+  }
+#endif
+
+#ifdef PROFILE_CCT
+  node_t *with_node = NODE(&PL, with_current->stack_node);
+
+  with_node->node_calls++;
+
+  with_node->node_ticks_self += with_current->stack_ticks_self;
+
+  with_node->node_ticks_total += with_current->stack_ticks_total;
+#endif
+
+  (*with_block->block_invocation_pointer)--;
+
+  PROFILE_BUG(*with_block->block_invocation_pointer < 0);
+
+  PG.counter_pointer = &(PG.counter_dummy);
+
+  if (PL.nstack > 0)
+  {
+    frame_t *with_previous = STACK(&PL, PL.nstack - 1);
+
+    with_previous->stack_ticks_total += with_current->stack_ticks_total;
+
+    PG.counter_pointer = &(with_previous->stack_counter_begin);
+
+    if (RECORD_EDGE(with_previous->stack_id, with_current->stack_id))
+    {
+      //update parent in child
+
+      edge_t *with_parent =
+        return_edge(&(PL.profile),
+                    &(BLOCK(&(PL.profile), with_current->stack_id)->block_parents),
+                    with_previous->stack_id);
+
+      with_parent->edge_calls++;
+
+      with_parent->edge_time_total += time_total;
+
+#ifdef PROFILE_WALL
+      with_parent->edge_time_off_total += time_off_total;
+#endif
+
+      //update child in parent
+
+      edge_t *with_child =
+        return_edge(&(PL.profile),
+                    &(BLOCK(&(PL.profile), with_previous->stack_id)->block_children),
+                    with_current->stack_id);
+
+      with_child->edge_calls++;
+
+      with_child->edge_time_total += time_total;
+
+#ifdef PROFILE_WALL
+      with_child->edge_time_off_total += time_off_total;
+#endif
+    }
+  }
+  else
+  {
+    GET_COUNTER(&(PL.counter_overhead_end));
+ 
+    counter_delta = TICKS(PL.counter_overhead_end) -
+                    TICKS(PL.counter_overhead_begin);
+
+    PL.profile.time_total += SECS(counter_delta);
+  }
+
+  write_end(&PL);
+
+  INTERNAL_END
+}
+
+#ifdef PROFILE_SAMPLE
+
+//the number of calls to the next sampled call is drawn uniformly from
+//1..2N-1, so that the sampled calls do not follow the patterns of the calls
+
+int next_sample(int n)
+{
+  if (n <= 1) return(1);
+
+  //xorshift
+
+  unsigned int x = PL.sample_random;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+
+  PL.sample_random = x;
+
+  return(1 + (int) (x % (2U * n - 1U)));
+}
+
+//a call that is not sampled is counted with the mean self and total time
+//of the sampled calls of the block so far, the estimated total time is
+//subtracted from the self time of the parent if the parent is sampled
+//a call of a de-instrumented block, and every call below it, is only
+//counted, so its time stays in the self time of the caller of the
+//de-instrumented block
+
+void skip_block(int pid, int block_id)
+{
+  (void) pid;
+
+  INTERNAL_BEGIN
+
+  write_begin(&PL);
+
+  block_t *with_block = BLOCK(&(PL.profile), block_id);
+
+  double time_self = 0.0;
+  double time_total = 0.0;
+
+  int folded = FOLDED(with_block);
+
+  if ((with_block->block_calls_sampled > 0) && !folded)
+  {
+    time_self = with_block->block_time_self_sampled /
+                with_block->block_calls_sampled;
+    time_total = with_block->block_time_total_sampled /
+                 with_block->block_calls_sampled;
+  }
+
+  with_block->block_calls++;
+
+  if (folded) with_block->block_calls_deinstrumented++;
+
+  with_block->block_time_self_total += time_self;
+
+#ifdef PROFILE_FLAT_RECURSION
+  //the total time of an outermost call includes its recursive calls,
+  //so it is estimated with the sampled outermost calls
+
+  if (OUTERMOST(with_block))
+  {
+    if (!folded)
+    {
+      time_total = with_block->block_calls_outermost_sampled > 0 ?
+                   with_block->block_time_outermost_sampled /
+                   with_block->block_calls_outermost_sampled : 0.0;
+
+      with_block->block_time_total += time_total;
+    }
+    else
+      with_block->block_calls_outermost_deinstrumented++;
+  }
+
+  count_depth(with_block);
+#else
+  with_block->block_time_total += time_total;
+#endif
+
+#ifdef PROFILE_SHM
+  export_block(block_id, with_block);
+#endif
+
+  if (PL.nstack > 0)
+  {
+    frame_t *with_previous = STACK(&PL, PL.nstack - 1);
+
+    //the estimated time of the call is in the total time of a sampled
+    //parent, not in its self time
+
+    if (PG.unsampled == 0)
+    {
+      long long ticks_total = llround(time_total * frequency);
+
+      with_previous->stack_ticks_self -= ticks_total;
+
+      with_previous->stack_ticks_total += ticks_total;
+    }
+
+    if (RECORD_EDGE(with_previous->stack_id, block_id))
+    {
+      edge_t *with_parent =
+        return_edge(&(PL.profile), &(with_block->block_parents),
+                    with_previous->stack_id);
+
+      with_parent->edge_calls++;
+
+      with_parent->edge_time_total += time_total;
+
+      edge_t *with_child =
+        return_edge(&(PL.profile),
+                    &(BLOCK(&(PL.profile), with_previous->stack_id)->block_children),
+                    block_id);
+
+      with_child->edge_calls++;
+
+      with_child->edge_time_total += time_total;
+    }
+  }
+
+  write_end(&PL);
+
+  int ichunk = PROFILE_CHUNK(PL.nstack, STACK_CHUNK);
+
+  if (PL.stack_chunk[ichunk] == NULL)
+    PL.stack_chunk[ichunk] = new_chunk(ichunk, STACK_CHUNK, sizeof(frame_t));
+
+  STACK(&PL, PL.nstack)->stack_id = block_id;
+
+#ifdef PROFILE_FUNCTIONS
+  STACK(&PL, PL.nstack)->stack_function = NULL;
+#endif
+
+#ifdef PROFILE_MALLOC
+  clear_malloc(STACK(&PL, PL.nstack));
+#endif
+
+#ifdef PROFILE_DEINSTRUMENT
+  STACK(&PL, PL.nstack)->stack_folded = folded;
+#endif
+
+  PL.nstack++;
+
+  PG.unsampled++;
+
+  INTERNAL_END
+}
+
+void end_skip(void)
+{
+  PL.nstack--;
+
+  PROFILE_BUG(PL.nstack < 0)
+
+  block_t *with_block = BLOCK(&(PL.profile), STACK(&PL, PL.nstack)->stack_id);
+
+#ifdef PROFILE_MALLOC
+  write_begin(&PL);
+
+  end_malloc(with_block, STACK(&PL, PL.nstack));
+
+  write_end(&PL);
+#endif
+
+  (*with_block->block_invocation_pointer)--;
+
+  PG.unsampled--;
+}
+
+#endif
+
+#ifdef PROFILE_FUNCTIONS
+
+//automatic function instrumentation, compile with -DPROFILE_FUNCTIONS and
+//compile the code to be profiled with -finstrument-functions
+//every function is a site, the hooks look up the state of the site of a
+//function in a hash table of the thread keyed by the address of the
+//function, the names of the functions are resolved with dladdr when the
+//profile is dumped or copied
+//the frame of a function keeps its address, so the exit hook ignores the
+//functions that were not entered or are excluded
+
+local int profile_functions = FALSE;
+
+//the name of a function until it is resolved
+
+local const char unresolved[] = "";
+
+//the functions in the comma separated list GWP_EXCLUDE are not profiled
+
+local int nexclude = 0;
+local char **exclude = NULL;
+
+local void read_exclude(void)
+{
+  char *list = getenv("GWP_EXCLUDE");
+
+  if (list == NULL) return;
+
+  PROFILE_BUG((list = strdup(list)) == NULL)
+
+  char *save;
+
+  for (char *name = strtok_r(list, ",", &save); name != NULL;
+       name = strtok_r(NULL, ",", &save))
+  {
+    PROFILE_BUG((exclude = realloc(exclude,
+      (nexclude + 1) * sizeof(char *))) == NULL)
+
+    exclude[nexclude++] = name;
+  }
+}
+
+local int excluded(void *function)
+{
+  if (nexclude == 0) return(FALSE);
+
+  Dl_info info;
+
+  if ((dladdr(function, &info) == 0) or (info.dli_sname == NULL))
+    return(FALSE);
+
+  for (int iexclude = 0; iexclude < nexclude; iexclude++)
+    if (strcmp(info.dli_sname, exclude[iexclude]) == 0) return(TRUE);
+
+  return(FALSE);
+}
+
+#define HASH_FUNCTION(X) \
+  ((((unsigned int) ((uintptr_t) (X) >> 2)) * 2654435761U) >> 8)
+
+#define FUNCTION_STATIC(W, I) CHUNK_ENTRY((W)->function_chunk, I, FUNCTION_CHUNK)
+
+local void grow_functions(profile_local_t *with)
+{
+  INTERNAL_BEGIN
+
+  int nfunction_hash = with->nfunction_hash == 0 ? FUNCTION_CHUNK :
+                       2 * with->nfunction_hash;
+
+  function_t *function_hash;
+
+  PROFILE_BUG((function_hash = calloc(nfunction_hash, sizeof(function_t))) ==
+              NULL)
+
+  unsigned int mask = nfunction_hash - 1;
+
+  for (int ifunction = 0; ifunction < with->nfunction_hash; ifunction++)
+  {
+    function_t *with_function = with->function_hash + ifunction;
+
+    if (with_function->function == NULL) continue;
+
+    unsigned int ihash = HASH_FUNCTION(with_function->function) & mask;
+
+    while(function_hash[ihash].function != NULL) ihash = (ihash + 1) & mask;
+
+    function_hash[ihash] = *with_function;
+  }
+
+  free(with->function_hash);
+
+  with->function_hash = function_hash;
+
+  with->nfunction_hash = nfunction_hash;
+
+  INTERNAL_END
+}
+
+//return the state of the site of function in the calling thread,
+//or NULL if the function is excluded
+
+local profile_static_t *return_function(profile_local_t *with, void *function)
+{
+  if (with->nfunction_hash > 0)
+  {
+    unsigned int mask = with->nfunction_hash - 1;
+    unsigned int ihash = HASH_FUNCTION(function) & mask;
+
+    while(with->function_hash[ihash].function != NULL)
+    {
+      function_t *with_function = with->function_hash + ihash;
+
+      if (with_function->function == function)
+      {
+        if (with_function->function_site == PROFILE_INVALID) return(NULL);
+
+        return(FUNCTION_STATIC(with, with_function->function_site));
+      }
+
+      ihash = (ihash + 1) & mask;
+    }
+  }
+
+  //keep the load factor below one half
+
+  if (2 * (with->nfunction + 1) > with->nfunction_hash) grow_functions(with);
+
+  unsigned int mask = with->nfunction_hash - 1;
+  unsigned int ihash = HASH_FUNCTION(function) & mask;
+
+  while(with->function_hash[ihash].function != NULL)
+    ihash = (ihash + 1) & mask;
+
+  function_t *with_function = with->function_hash + ihash;
+
+  with_function->function = function;
+
+  with->nfunction++;
+
+  if (excluded(function))
+  {
+    with_function->function_site = PROFILE_INVALID;
+
+    return(NULL);
+  }
+
+  int site = with->nfunction_site++;
+
+  int ichunk = PROFILE_CHUNK(site, FUNCTION_CHUNK);
+
+  if (with->function_chunk[ichunk] == NULL)
+  {
+    with->function_chunk[ichunk] =
+      new_chunk(ichunk, FUNCTION_CHUNK, sizeof(profile_static_t));
+
+    clear_static(with->function_chunk[ichunk], FUNCTION_CHUNK << ichunk);
+  }
+
+  with_function->function_site = site;
+
+  return(FUNCTION_STATIC(with, site));
+}
+
+//the name of a function is its symbol, or the object and the offset of the
+//function if the symbol is not exported, link with -rdynamic to export the
+//symbols of the executable
+
+//the names are interned, since a shared library can be unloaded
+
+#define RESOLVE_MAX 256
+
+local const char *resolve_name(void *function)
+{
+  char name[RESOLVE_MAX];
+
+  Dl_info info;
+
+  if (dladdr(function, &info) == 0)
+    snprintf(name, RESOLVE_MAX, "%p", function);
+  else if (info.dli_sname != NULL)
+    return(intern_name(info.dli_sname));
+  else
+  {
+    const char *object = info.dli_fname == NULL ? "" : info.dli_fname;
+
+    if (strrchr(object, '/') != NULL) object = strrchr(object, '/') + 1;
+
+    snprintf(name, RESOLVE_MAX, "%s+0x%lx", object,
+             (unsigned long) ((char *) function - (char *) info.dli_fbase));
+  }
+
+  return(intern_name(name));
+}
+
+local void resolve_names(profile_t *with_profile)
+{
+  for (int iblock = 0; iblock < with_profile->nblock; iblock++)
+  {
+    block_t *with_block = BLOCK(with_profile, iblock);
+
+    if (with_block->block_address == NULL) continue;
+
+    with_block->block_name = resolve_name(with_block->block_address);
+
+    with_block->block_address = NULL;
+  }
+}
+
+void __cyg_profile_func_enter(void *, void *)
+  __attribute__((no_instrument_function));
+void __cyg_profile_func_exit(void *, void *)
+  __attribute__((no_instrument_function));
+
+#ifdef PROFILE_SAMPLE
+
+void __cyg_profile_func_enter(void *function, void *call_site)
+{
+  (void) call_site;
+
+  if (!__atomic_load_n(&profile_functions, __ATOMIC_RELAXED)) return;
+
+  int pid = PID;
+
+  profile_static_t *profile_static = return_function(&PL, function);
+
+  if (profile_static == NULL) return;
+
+  PS.block_invocation++;
+
+  if (PROFILE_BLOCK_ID == PROFILE_INVALID)
+    add_site_block(unresolved, function, profile_static);
+
+  if (PROFILE_SKIP)
+    skip_block(pid, PROFILE_BLOCK_ID);
+  else
+  {
+    counter_t counter_stamp;
+
+    PS.block_sample = next_sample(PROFILE_SAMPLE);
+
+    GET_COUNTER(&counter_stamp);
+
+    PG.counter_stamp = counter_stamp;
+
+    begin_block(pid, PROFILE_BLOCK_ID);
+  }
+
+  STACK(&PL, PL.nstack - 1)->stack_function = function;
+
+  if (PG.unsampled == 0) GET_COUNTER(PG.counter_pointer);
+}
+
+void __cyg_profile_func_exit(void *function, void *call_site)
+{
+  (void) call_site;
+
+  if ((profile_local == NULL) or (PL.nstack == 0) or
+      (STACK(&PL, PL.nstack - 1)->stack_function != function)) return;
+
+  if (PG.unsampled > 0)
+    end_skip();
+  else
+  {
+    counter_t counter_stamp;
+
+    GET_COUNTER(&counter_stamp);
+
+    PG.counter_stamp = counter_stamp;
+
+    end_block(profile_pid);
+
+    GET_COUNTER(PG.counter_pointer);
+  }
+}
+
+#else
+
+void __cyg_profile_func_enter(void *function, void *call_site)
+{
+  (void) call_site;
+
+  if (!__atomic_load_n(&profile_functions, __ATOMIC_RELAXED)) return;
+
+  int pid = PID;
+
+  //an excluded function does not read the counter
+
+  profile_static_t *profile_static = return_function(&PL, function);
+
+  if (profile_static == NULL) return;
+
+  PS.block_invocation++;
+
+  if (PROFILE_BLOCK_ID == PROFILE_INVALID)
+    add_site_block(unresolved, function, profile_static);
+
+  counter_t counter_stamp;
+
+  GET_COUNTER(&counter_stamp);
+
+  PG.counter_stamp = counter_stamp;
+
+  begin_block(pid, PROFILE_BLOCK_ID);
+
+  STACK(&PL, PL.nstack - 1)->stack_function = function;
+
+  GET_COUNTER(PG.counter_pointer);
+}
+
+void __cyg_profile_func_exit(void *function, void *call_site)
+{
+  (void) call_site;
+
+  if ((profile_local == NULL) or (PL.nstack == 0) or
+      (STACK(&PL, PL.nstack - 1)->stack_function != function)) return;
+
+  counter_t counter_stamp;
+
+  GET_COUNTER(&counter_stamp);
+
+  PG.counter_stamp = counter_stamp;
+
+  end_block(profile_pid);
+
+  GET_COUNTER(PG.counter_pointer);
+}
+
+#endif
+
+#endif
+
+#if (PROFILE_COUNTER == PROFILE_COUNTER_TSC) || \
+    (PROFILE_COUNTER == PROFILE_COUNTER_TSCP)
+
+//CPUID.80000007H:EDX[8] is set if the TSC runs at a constant rate
+//in all ACPI P-, C- and T-states
+
+local int invariant_tsc(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0) return(FALSE);
+
+  if (eax < 0x80000007) return(FALSE);
+
+  if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0) return(FALSE);
+
+  return((edx & (1 << 8)) != 0);
+}
+
+#define FREQUENCY_NSECS 50000000LL
+
+//count the ticks of the TSC against CLOCK_MONOTONIC
+
+local long long measure_frequency(void)
+{
+  struct timespec monotonic_begin;
+  struct timespec monotonic_end;
+  counter_t counter_begin;
+  counter_t counter_end;
+
+  PROFILE_BUG(clock_gettime(CLOCK_MONOTONIC, &monotonic_begin) != 0)
+  GET_COUNTER(&counter_begin);
+
+  long long nsecs;
+
+  do
+  {
+    PROFILE_BUG(clock_gettime(CLOCK_MONOTONIC, &monotonic_end) != 0)
+    GET_COUNTER(&counter_end);
+
+    nsecs = (monotonic_end.tv_sec - monotonic_begin.tv_sec) * 1000000000LL +
+            (monotonic_end.tv_nsec - monotonic_begin.tv_nsec);
+  }
+  while(nsecs < FREQUENCY_NSECS);
+
+  return(llround((double) (TICKS(counter_end) - TICKS(counter_begin)) *
+                 1000000000.0 / (double) nsecs));
+}
+
+#else
+
+//the clock_gettime counters count nanoseconds
+
+local long long measure_frequency(void)
+{
+  return(1000000000LL);
+}
+
+#endif
+
+//the intrinsic profile overhead is sampled in batches of NCALL_BATCH
+//until the mean and sigma after two consecutive batches differ less than
+//TOLERANCE_MEAN and TOLERANCE_SIGMA, or NCALL samples have been taken
+//sigma converges slower, since it is dominated by rare large samples
+
+#define NCALL       1000000LL
+#define NCALL_BATCH 10000LL
+#define NCALL_MIN   (2 * NCALL_BATCH)
+#define TOLERANCE_MEAN  0.01
+#define TOLERANCE_SIGMA 0.05
+
+local int converged(double x, double previous, double tolerance)
+{
+  return(fabs(x - previous) <= tolerance * fabs(x));
+}
+
+local void calibrate(void)
+{
+  frequency = measure_frequency();
+
+  double mn = 0.0;
+  double sn = 0.0;
+
+  double mean_previous = 0.0;
+  double sigma_previous = 0.0;
+
+  for (ncall = 1; ncall <= NCALL; ++ncall)
+  {
+    counter_t counter_stamp;
+  
+    GET_COUNTER(&counter_stamp);
+    GET_COUNTER(PG.counter_pointer);
+  
+    update_mean_sigma(ncall, TICKS(PG.counter_dummy) - TICKS(counter_stamp),
+                      &mn, &sn);
+
+    if ((ncall % NCALL_BATCH) == 0)
+    {
+      double sigma = sqrt(sn / (ncall - 1));
+
+      if ((ncall >= NCALL_MIN) &&
+          converged(mn, mean_previous, TOLERANCE_MEAN) &&
+          converged(sigma, sigma_previous, TOLERANCE_SIGMA)) break;
+
+      mean_previous = mn;
+      sigma_previous = sigma;
+    }
+  }
+  if (ncall > NCALL) ncall = NCALL;
+
+  counter_mean = round(mn);
+  counter_sigma = ncall > 1 ? round(sqrt(sn / (ncall - 1))) : 0;
+
+  ncounter_largest = 0;
+  counter_largest = 0;
+
+  for (long long n = 1; n <= ncall; ++n)
+  {
+    counter_t counter_stamp;
+  
+    GET_COUNTER(&counter_stamp);
+    GET_COUNTER(PG.counter_pointer);
+
+    long long delta = TICKS(PG.counter_dummy) - TICKS(counter_stamp);
+
+    if (delta > (counter_mean + 3 * counter_sigma))
+    {
+      ++ncounter_largest;
+      counter_largest = delta;
+    }
+  }
+}
+
+//if GWP_CALIBRATION names a file the calibration is cached in that file,
+//one line per host and counter:
+//<version> <host> <counter> <frequency> <mean> <sigma> <ncall> <nlargest> <largest>
+//lines of another version are ignored, so they are replaced by a new
+//calibration
+
+#define CALIBRATION_ENV "GWP_CALIBRATION"
+
+#define CALIBRATION_VERSION 2
+
+#define CALIBRATION_HOST_MAX 256
+#define CALIBRATION_LINE_MAX 1024
+
+local int load_calibration(void)
+{
+  const char *name = getenv(CALIBRATION_ENV);
+
+  if ((name == NULL) or (*name == '\0')) return(FALSE);
+
+  char host[CALIBRATION_HOST_MAX];
+
+  if (gethostname(host, CALIBRATION_HOST_MAX) != 0) return(FALSE);
+
+  host[CALIBRATION_HOST_MAX - 1] = '\0';
+
+  FILE *f;
+
+  if ((f = fopen(name, "r")) == NULL) return(FALSE);
+
+  int result = FALSE;
+
+  char line[CALIBRATION_LINE_MAX];
+
+  while(fgets(line, CALIBRATION_LINE_MAX, f) != NULL)
+  {
+    char line_host[CALIBRATION_HOST_MAX];
+    char line_counter[NAME_MAX];
+    long long line_frequency, line_mean, line_sigma, line_ncall;
+    long long line_ncounter_largest, line_counter_largest;
+    int line_version;
+
+    if (sscanf(line, "%d %255s %31s %lld %lld %lld %lld %lld %lld",
+               &line_version, line_host, line_counter, &line_frequency,
+               &line_mean, &line_sigma, &line_ncall, &line_ncounter_largest,
+               &line_counter_largest) != 9) continue;
+
+    if (line_version != CALIBRATION_VERSION) continue;
+
+    if (strcmp(line_host, host) != 0) continue;
+
+    if (strcmp(line_counter, PROFILE_COUNTER_NAME) != 0) continue;
+
+    //the last line for the host and counter wins
+
+    frequency = line_frequency;
+    counter_mean = line_mean;
+    counter_sigma = line_sigma;
+    ncall = line_ncall;
+    ncounter_largest = line_ncounter_largest;
+    counter_largest = line_counter_largest;
+
+    result = TRUE;
+  }
+
+  fclose(f);
+
+  return(result);
+}
+
+local void save_calibration(void)
+{
+  const char *name = getenv(CALIBRATION_ENV);
+
+  if ((name == NULL) or (*name == '\0')) return;
+
+  char host[CALIBRATION_HOST_MAX];
+
+  if (gethostname(host, CALIBRATION_HOST_MAX) != 0) return;
+
+  host[CALIBRATION_HOST_MAX - 1] = '\0';
+
+  char line[CALIBRATION_LINE_MAX];
+
+  int nline = snprintf(line, CALIBRATION_LINE_MAX,
+                       "%d %s %s %lld %lld %lld %lld %lld %lld\n",
+                       CALIBRATION_VERSION, host, PROFILE_COUNTER_NAME,
+                       frequency, counter_mean, counter_sigma, ncall,
+                       ncounter_largest, counter_largest);
+
+  if ((nline <= 0) or (nline >= CALIBRATION_LINE_MAX)) return;
+
+  //a single append, so concurrent processes do not interleave lines
+
+  int fd;
+
+  if ((fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1)
+  {
+    fprintf(stderr, "profile: cannot write the calibration to %s\n", name);
+
+    return;
+  }
+
+  if (write(fd, line, nline) != nline)
+    fprintf(stderr, "profile: cannot write the calibration to %s\n", name);
+
+  close(fd);
+}
+
+//the names of the profiles start with profile_output, which is "profile" or
+//the template in GWP_OUTPUT expanded by init_profile, so processes that
+//share a directory do not overwrite each others profiles
+//%h is the host name, %p the process id, %r the rank (0 without a rank)
+//and %% a %, the directories of the template are created
+//the rank is the value of the variable named in GWP_RANK_ENV or of the rank
+//variable of the usual MPI launchers
+
+#define PROFILE_PATH_MAX 1024
+
+//keep room for the suffixes
+
+#define OUTPUT_MAX (PROFILE_PATH_MAX - NAME_MAX)
+
+local char profile_output[OUTPUT_MAX] = "profile";
+
+local char output_host[HOST_MAX] = "";
+local int output_rank = PROFILE_INVALID;
+
+local const char *rank_variables[] =
+  {"OMPI_COMM_WORLD_RANK", "PMI_RANK", "PMIX_RANK", "SLURM_PROCID", NULL};
+
+local const char *return_rank(void)
+{
+  const char *name = getenv("GWP_RANK_ENV");
+
+  if (name != NULL) return(getenv(name));
+
+  for (int ivariable = 0; rank_variables[ivariable] != NULL; ivariable++)
+    if (getenv(rank_variables[ivariable]) != NULL)
+      return(getenv(rank_variables[ivariable]));
+
+  return(NULL);
+}
+
+//mkdir -p of the directories of path, other processes can create the same
+//directories concurrently
+
+local void make_directories(const char *path)
+{
+  char directory[PROFILE_PATH_MAX];
+
+  snprintf(directory, PROFILE_PATH_MAX, "%s", path);
+
+  for (char *c = directory + 1; *c != '\0'; c++)
+  {
+    if (*c != '/') continue;
+
+    *c = '\0';
+
+    if ((mkdir(directory, 0777) != 0) && (errno != EEXIST))
+    {
+      fprintf(stderr, "profile: cannot create the directory %s\n", directory);
+      exit(EXIT_FAILURE);
+    }
+
+    *c = '/';
+  }
+}
+
+local void expand_output(void)
+{
+  if (gethostname(output_host, HOST_MAX) != 0) output_host[0] = '\0';
+
+  output_host[HOST_MAX - 1] = '\0';
+
+  const char *rank = return_rank();
+
+  if (rank != NULL) output_rank = atoi(rank);
+
+  const char *template = getenv("GWP_OUTPUT");
+
+  if ((template == NULL) or (*template == '\0')) return;
+
+  int n = 0;
+
+  for (const char *c = template; (*c != '\0') && (n < OUTPUT_MAX); c++)
+  {
+    if ((c[0] != '%') or (c[1] == '\0'))
+    {
+      profile_output[n++] = *c;
+
+      continue;
+    }
+
+    c++;
+
+    if (*c == 'h')
+      n += snprintf(profile_output + n, OUTPUT_MAX - n, "%s", output_host);
+    else if (*c == 'p')
+      n += snprintf(profile_output + n, OUTPUT_MAX - n, "%d", (int) getpid());
+    else if (*c == 'r')
+      n += snprintf(profile_output + n, OUTPUT_MAX - n, "%s",
+                    rank == NULL ? "0" : rank);
+    else if (*c == '%')
+      profile_output[n++] = '%';
+    else
+      n += snprintf(profile_output + n, OUTPUT_MAX - n, "%%%c", *c);
+  }
+
+  if (n >= OUTPUT_MAX)
+  {
+    fprintf(stderr, "profile: GWP_OUTPUT is too long\n");
+    exit(EXIT_FAILURE);
+  }
+
+  profile_output[n] = '\0';
+
+  make_directories(profile_output);
+}
+
+#ifdef PROFILE_TRACE
+
+#define TRACE_SUFFIX "-trace.json"
+
+//the drainer wakes up every TRACE_NSECS nanoseconds
+
+#define TRACE_NSECS 10000000L
+
+local FILE *trace_file = NULL;
+local pthread_t trace_thread;
+local int trace_stop = FALSE;
+local long long trace_ticks_begin;
+local int trace_nthread = 0;
+
+//the events in the Chrome trace event format, time stamps are in
+//microseconds
+
+local void drain_trace(int pid, profile_local_t *with)
+{
+  trace_t *with_trace = with->trace;
+
+  long long tail = with_trace->trace_tail;
+  long long head = __atomic_load_n(&(with_trace->trace_head), __ATOMIC_ACQUIRE);
+
+  for (; tail < head; tail++)
+  {
+    event_t *with_event = with_trace->trace_event +
+                          (tail & (PROFILE_TRACE_RING - 1));
+
+    fprintf(trace_file, ",\n{\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                        "\"ts\":%.3f,\"dur\":%.3f,\"name\":\"",
+      (int) getpid(), pid,
+      (with_event->event_begin - trace_ticks_begin) * 1000000.0 / TRACE_FREQUENCY,
+      (with_event->event_end - with_event->event_begin) * 1000000.0 /
+        TRACE_FREQUENCY);
+
+    block_t *with_block = BLOCK(&(with->profile), with_event->event_block_id);
+
+    for (const char *c = with_block->block_name; *c != '\0'; c++)
+    {
+      if ((*c == '"') or (*c == '\\')) fputc('\\', trace_file);
+
+      fputc(*c, trace_file);
+    }
+
+    fprintf(trace_file, "\",\"args\":{\"invocation\":%d}}",
+      with_block->block_invocation);
+
+    __atomic_store_n(&(with_trace->trace_tail), tail + 1, __ATOMIC_RELEASE);
+  }
+}
+
+local void drain_traces(void)
+{
+  pthread_mutex_lock(&profile_mutex);
+
+  int ndrain = nthread;
+
+  pthread_mutex_unlock(&profile_mutex);
+
+  for (int pid = 0; pid < ndrain; pid++)
+  {
+    if (pid >= trace_nthread)
+    {
+      fprintf(trace_file, ",\n{\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                          "\"name\":\"thread_name\",\"args\":{\"name\":\"thread-%d\"}}",
+        (int) getpid(), pid, pid);
+
+      trace_nthread = pid + 1;
+    }
+
+    drain_trace(pid, CHUNK_ENTRY(profile_local_chunk, pid, THREAD_CHUNK));
+  }
+
+  fflush(trace_file);
+}
+
+local void *drainer(void *arg)
+{
+  (void) arg;
+
+  struct timespec interval = {0, TRACE_NSECS};
+
+  while(!__atomic_load_n(&trace_stop, __ATOMIC_ACQUIRE))
+  {
+    drain_traces();
+
+    nanosleep(&interval, NULL);
+  }
+
+  return(NULL);
+}
+
+//drain the events that are left and report the dropped events
+
+local void stop_trace(void)
+{
+  __atomic_store_n(&trace_stop, TRUE, __ATOMIC_RELEASE);
+
+  PROFILE_BUG(pthread_join(trace_thread, NULL) != 0)
+
+  drain_traces();
+
+  fprintf(trace_file, "\n]\n");
+
+  fclose(trace_file);
+
+  long long ndropped = 0;
+
+  for (int pid = 0; pid < trace_nthread; pid++)
+    ndropped += CHUNK_ENTRY(profile_local_chunk, pid, THREAD_CHUNK)->
+                  trace->trace_ndropped;
+
+  if (ndropped > 0)
+    fprintf(stderr, "profile: %lld events were dropped from the trace, "
+                    "increase PROFILE_TRACE_RING\n", ndropped);
+}
+
+local void start_trace(void)
+{
+  char name[PROFILE_PATH_MAX];
+
+  snprintf(name, PROFILE_PATH_MAX, "%s%s", profile_output, TRACE_SUFFIX);
+
+  PROFILE_BUG((trace_file = fopen(name, "w")) == NULL)
+
+  //the trace event format also accepts a trace without the closing ']',
+  //so the trace is usable if the program does not exit normally
+
+  fprintf(trace_file, "[\n{\"ph\":\"M\",\"pid\":%d,\"name\":\"process_name\","
+                      "\"args\":{\"name\":\"gwp\"}}", (int) getpid());
+
+#if PROFILE_COUNTER != PROFILE_COUNTER_THREAD
+  GET_COUNTER(&(PG.counter_stamp));
+#endif
+
+  trace_ticks_begin = TRACE_TICKS;
+
+  PROFILE_BUG(pthread_create(&trace_thread, NULL, drainer, NULL) != 0)
+
+  PROFILE_BUG(atexit(stop_trace) != 0)
+}
+
+#endif
+
+local const char *profile_suffixes[] = {"txt", "gwp", "folded", NULL};
+
+local int digits(const char *c, size_t n)
+{
+  if (n == 0) return(FALSE);
+
+  for (size_t i = 0; i < n; i++)
+    if ((c[i] < '0') or (c[i] > '9')) return(FALSE);
+
+  return(TRUE);
+}
+
+//TRUE if path is <output>-<thread>.<suffix>, <output>-all.<suffix> or
+//<output>-snapshot-<n>.<suffix>, the names of the profiles written by
+//dump_profile, dump_profile_all and snapshot_profile, other files that
+//start with the output are left alone
+
+local int generated(const char *path, const char *suffix)
+{
+  size_t noutput = strlen(profile_output);
+  size_t nsuffix = strlen(suffix);
+  size_t npath = strlen(path);
+
+  if (npath < noutput + nsuffix + 2) return(FALSE);
+
+  const char *middle = path + noutput + 1;
+
+  size_t n = npath - noutput - nsuffix - 2;
+
+  if ((n == 3) && (strncmp(middle, "all", 3) == 0)) return(TRUE);
+
+  if ((n > 9) && (strncmp(middle, "snapshot-", 9) == 0))
+    return(digits(middle + 9, n - 9));
+
+  return(digits(middle, n));
+}
+
+#ifdef PROFILE_SNAPSHOT_SIGNAL
+local void start_snapshot(void);
+#endif
+
+local void retire_thread(void *);
+
+void init_profile(void)
+{
+  INTERNAL_BEGIN
+
+  PROFILE_BUG(pthread_mutex_init(&profile_mutex, NULL) != 0)
+
+  nthread = 0;
+
+  nsite = 0;
+
+  expand_output();
+
+  //remove the profiles of a previous run
+
+  char name[PROFILE_PATH_MAX];
+
+  for (int isuffix = 0; profile_suffixes[isuffix] != NULL; isuffix++)
+  {
+    snprintf(name, PROFILE_PATH_MAX, "%s.%s", profile_output,
+             profile_suffixes[isuffix]);
+
+    (void) remove(name);
+
+    snprintf(name, PROFILE_PATH_MAX, "%s-*.%s", profile_output,
+             profile_suffixes[isuffix]);
+
+    glob_t profiles;
+
+    if (glob(name, 0, NULL, &profiles) == 0)
+    {
+      for (size_t iprofile = 0; iprofile < profiles.gl_pathc; iprofile++)
+        if (generated(profiles.gl_pathv[iprofile], profile_suffixes[isuffix]))
+          (void) remove(profiles.gl_pathv[iprofile]);
+
+      globfree(&profiles);
+    }
+  }
+
+  snprintf(name, PROFILE_PATH_MAX, "%s-trace.json", profile_output);
+
+  (void) remove(name);
+
+#if (PROFILE_COUNTER == PROFILE_COUNTER_TSC) || \
+    (PROFILE_COUNTER == PROFILE_COUNTER_TSCP)
+  if (!invariant_tsc())
+    fprintf(stderr, "profile: the TSC is not invariant, "
+                    "the %s counter may drift\n", PROFILE_COUNTER_NAME);
+#endif
+
+#ifdef PROFILE_REGISTER
+  //collect the names of the registered sites
+
+  pthread_mutex_lock(&register_mutex);
+
+  nsite_all = PROFILE_NSITE + nsite_registered + PROFILE_REGISTER_LATE;
+
+  const char **names;
+
+  PROFILE_BUG((names = malloc(nsite_all * sizeof(const char *))) == NULL)
+
+  for (int isite = 0; isite < PROFILE_NSITE + nsite_registered; isite++)
+    names[isite] = isite < PROFILE_NSITE ? __start_gwp_sites[isite] :
+                   site_registered[isite - PROFILE_NSITE];
+
+  for (int isite = PROFILE_NSITE + nsite_registered; isite < nsite_all; isite++)
+    names[isite] = SITE_LATE_NAME;
+
+  site_names = names;
+
+  pthread_mutex_unlock(&register_mutex);
+#endif
+
+#ifdef PROFILE_SHM
+  create_shm();
+#endif
+
+  PROFILE_BUG(pthread_key_create(&profile_key, retire_thread) != 0)
+
+  //the main thread is pid 0
+
+  (void) PID;
+
+  PG.counter_pointer = &(PG.counter_dummy);
+
+  if (!load_calibration())
+  {
+    calibrate();
+
+    save_calibration();
+  }
+
+  PL.counter_correction = counter_mean;
+
+#ifdef PROFILE_TRACE
+  start_trace();
+#endif
+
+#ifdef PROFILE_SNAPSHOT_SIGNAL
+  start_snapshot();
+#endif
+
+#ifdef PROFILE_FUNCTIONS
+  read_exclude();
+
+  __atomic_store_n(&profile_functions, TRUE, __ATOMIC_RELEASE);
+#endif
+
+
+  INTERNAL_END
+}
+
+//copy the calibration and the blocks that are not terminated to the
+//profile of with
+
+local void fill_header(profile_t *with_profile, profile_local_t *with)
+{
+  strncpy(with_profile->profile_counter, PROFILE_COUNTER_NAME, NAME_MAX - 1);
+  with_profile->profile_frequency = frequency;
+  with_profile->profile_counter_mean = counter_mean;
+  with_profile->profile_counter_sigma = counter_sigma;
+  with_profile->profile_ncall = ncall;
+  with_profile->profile_ncounter_largest = ncounter_largest;
+  with_profile->profile_counter_largest = counter_largest;
+#ifdef PROFILE_FIXED_CORRECTION
+  with_profile->profile_fixed_correction = TRUE;
+#else
+  with_profile->profile_fixed_correction = FALSE;
+#endif
+  with_profile->profile_counter_correction = with->counter_correction;
+  with_profile->profile_stamp = time(NULL);
+  memcpy(with_profile->profile_host, output_host, HOST_MAX);
+  with_profile->profile_process = getpid();
+  with_profile->profile_rank = output_rank;
+#ifdef PROFILE_PERF
+  with_profile->profile_perf = with->perf;
+#else
+  with_profile->profile_perf = 0;
+#endif
+#ifdef PROFILE_WALL
+  with_profile->profile_wall = TRUE;
+#else
+  with_profile->profile_wall = FALSE;
+#endif
+#ifdef PROFILE_MALLOC
+  with_profile->profile_malloc = TRUE;
+#else
+  with_profile->profile_malloc = FALSE;
+#endif
+#ifdef PROFILE_FLAT_RECURSION
+  with_profile->profile_flat_recursion = TRUE;
+#else
+  with_profile->profile_flat_recursion = FALSE;
+#endif
+  //-DPROFILE_DEINSTRUMENT implies -DPROFILE_SAMPLE=1
+
+#ifdef PROFILE_SAMPLE
+  with_profile->profile_sample = PROFILE_SAMPLE;
+#else
+  with_profile->profile_sample = 0;
+#endif
+#ifdef PROFILE_DEINSTRUMENT
+  with_profile->profile_deinstrument = PROFILE_DEINSTRUMENT;
+#else
+  with_profile->profile_deinstrument = 0;
+#endif
+}
+
+local void fill_profile(profile_local_t *with)
+{
+  profile_t *with_profile = &(with->profile);
+
+  fill_header(with_profile, with);
+
+  PROFILE_BUG((with_profile->stack = realloc(with_profile->stack,
+    (with->nstack + 1) * sizeof(int))) == NULL)
+
+  with_profile->nstack = with->nstack;
+
+  for (int istack = 0; istack < with->nstack; istack++)
+    with_profile->stack[istack] = STACK(with, istack)->stack_id;
+
+#ifdef PROFILE_FUNCTIONS
+  write_begin(with);
+
+  resolve_names(with_profile);
+
+  write_end(with);
+#endif
+}
+
+local void free_static(profile_static_t *chunk, int nsite_chunk)
+{
+  for (int isite = 0; isite < nsite_chunk; isite++)
+    if (chunk[isite].nblock_id > 0) free(chunk[isite].block_id);
+
+  free(chunk);
+}
+
+#ifdef PROFILE_CCT
+
+//merge the calling context tree of a thread that exits into the tree of
+//the retired threads, the blocks of the thread are already merged
+
+local void retire_nodes(profile_local_t *with)
+{
+  if (with->nnode == 0) return;
+
+  if (retired_local.nnode == 0)
+    (void) add_node(&retired_local, PROFILE_INVALID, PROFILE_INVALID);
+
+  int *map;
+
+  PROFILE_BUG((map = malloc(with->nnode * sizeof(int))) == NULL)
+
+  map[0] = 0;
+
+  //the parent of a node is created before the node
+
+  for (int node = 1; node < with->nnode; node++)
+  {
+    node_t *with_node = NODE(with, node);
+
+    block_t *with_block = BLOCK(&(with->profile), with_node->node_block_id);
+
+    int block_id = find_block(&(retired_local.profile), with_block->block_name,
+                              with_block->block_invocation);
+
+    map[node] = return_node(&retired_local, map[with_node->node_parent],
+                            block_id);
+
+    node_t *with_retired = NODE(&retired_local, map[node]);
+
+    with_retired->node_calls += with_node->node_calls;
+
+    with_retired->node_ticks_self += with_node->node_ticks_self;
+
+    with_retired->node_ticks_total += with_node->node_ticks_total;
+  }
+
+  free(map);
+}
+
+#endif
+
+//the destructor of profile_key, called by a thread that exits
+//the profile of the thread is merged into the profile of the retired
+//threads, the state of its sites is freed and its slot is put on the
+//free list
+
+#define RETIRE_NSECS 100000L
+
+local void retire_thread(void *arg)
+{
+  INTERNAL_BEGIN
+
+  profile_local_t *with = arg;
+
+#ifdef PROFILE_TRACE
+  //the events in the ring buffer refer to the blocks of the thread
+
+  struct timespec interval = {0, TRACE_NSECS};
+
+  while(!__atomic_load_n(&trace_stop, __ATOMIC_ACQUIRE) &&
+        (__atomic_load_n(&(with->trace->trace_tail), __ATOMIC_ACQUIRE) !=
+         with->trace->trace_head))
+    nanosleep(&interval, NULL);
+#endif
+
+  //the queries that pinned the slot copy it without snapshot_mutex,
+  //the thread does not update its profile any more, so they do not have
+  //to wait for it, the thread waits without snapshot_mutex, so new threads
+  //and snapshots do not wait for the queries
+
+  pthread_mutex_lock(&snapshot_mutex);
+
+  with->retiring = TRUE;
+
+  pthread_mutex_unlock(&snapshot_mutex);
+
+  struct timespec interval_readers = {0, RETIRE_NSECS};
+
+  while(__atomic_load_n(&(with->readers), __ATOMIC_ACQUIRE) > 0)
+    nanosleep(&interval_readers, NULL);
+
+  pthread_mutex_lock(&snapshot_mutex);
+
+  fill_profile(with);
+
+  merge_profile(&(retired_local.profile), &(with->profile));
+
+#ifdef PROFILE_CCT
+  retire_nodes(with);
+#endif
+
+  free_profile(&(with->profile));
+
+  for (int ichunk = 0; ichunk < PROFILE_CHUNK_MAX; ichunk++)
+  {
+    if (profile_static_chunk[ichunk] == NULL) continue;
+
+    free_static(profile_static_chunk[ichunk], PROFILE_STATIC_CHUNK << ichunk);
+
+    profile_static_chunk[ichunk] = NULL;
+  }
+
+#ifdef PROFILE_REGISTER
+  free_static(profile_static_site, nsite_all);
+
+  profile_static_site = NULL;
+#endif
+
+#ifdef PROFILE_FUNCTIONS
+  for (int ichunk = 0; ichunk < PROFILE_CHUNK_MAX; ichunk++)
+  {
+    if (with->function_chunk[ichunk] == NULL) continue;
+
+    free_static(with->function_chunk[ichunk], FUNCTION_CHUNK << ichunk);
+
+    with->function_chunk[ichunk] = NULL;
+  }
+
+  free(with->function_hash);
+
+  with->function_hash = NULL;
+
+  with->nfunction = 0;
+  with->nfunction_site = 0;
+  with->nfunction_hash = 0;
+#endif
+
+#ifdef PROFILE_PERF
+  close_perf(with);
+#endif
+
+  pthread_mutex_lock(&profile_mutex);
+
+  with->in_use = FALSE;
+
+  if (nfree_pid >= nfree_pid_max)
+  {
+    nfree_pid_max = (nfree_pid_max == 0) ? THREAD_CHUNK : 2 * nfree_pid_max;
+
+    PROFILE_BUG((free_pid = realloc(free_pid, nfree_pid_max * sizeof(int))) ==
+                NULL)
+  }
+
+  free_pid[nfree_pid++] = profile_pid;
+
+  pthread_mutex_unlock(&profile_mutex);
+
+  pthread_mutex_unlock(&snapshot_mutex);
+
+  //blocks in later destructors register the thread again
+
+  profile_local = NULL;
 
-  pthread_mutex_unlock(&profile_mutex);
+  profile_pid = PROFILE_INVALID;
 
-  return(result);
+  INTERNAL_END
 }
 
-void init_block(int block_id[RECURSE_MAX])
+//clear the profile of the retired threads, called with snapshot_mutex taken
+
+local void clear_retired(void)
 {
-  for (int iblock = 0; iblock < RECURSE_MAX; iblock++)
-    block_id[iblock] = PROFILE_INVALID;
+  free_profile(&(retired_local.profile));
+
+#ifdef PROFILE_CCT
+  retired_local.nnode = 0;
+
+  for (int ihash = 0; ihash < retired_local.nnode_hash; ihash++)
+    retired_local.node_hash[ihash] = PROFILE_INVALID;
+#endif
 }
 
-local void clear_block(block_t *with_block)
-{
-  with_block->block_calls = 0;
+//profiles are dumped as text, or with -DPROFILE_BINARY in the binary
+//format of write_profile for gwp-report
+
+#ifdef PROFILE_BINARY
+#define PROFILE_SUFFIX "gwp"
+#else
+#define PROFILE_SUFFIX "txt"
+#endif
 
-  with_block->block_time_self_total = 0.0;
-  with_block->block_time_total = 0.0;
+local void output_profile(const char *name, profile_t *with, int verbose)
+{
+#ifdef PROFILE_BINARY
+  (void) verbose;
 
-  for (int iblock = 0; iblock < BLOCK_MAX; iblock++)
-  {
-    child_t *with_child = with_block->block_child + iblock;
+  write_profile(name, with);
+#else
+  FILE *f;
 
-    with_child->child_active = FALSE;
-    with_child->child_calls = 0;
-    with_child->child_time_total = 0.0;
+  PROFILE_BUG((f = fopen(name, "w")) == NULL)
 
-    parent_t *with_parent = with_block->block_parent + iblock;
+  report_profile(f, with, SORT_DEFAULT, verbose);
 
-    with_parent->parent_active = FALSE;
-    with_parent->parent_calls = 0;
-  }
+  fclose(f);
+#endif
 }
 
-#define MANGLE_MAX 256
+#ifdef PROFILE_CCT
 
-local void mangle(char *dest, const char *source)
+//write the calling context tree of with in the folded stack format of
+//flame graphs: the names of the blocks on the call path separated by ';'
+//followed by the self ticks of the path
+
+local void write_folded(FILE *f, profile_local_t *with)
 {
-  char m[MANGLE_MAX];
+  int npath = 0;
+  int *path = NULL;
 
-  if (strlen(source) < NAME_MAX)
-    strncpy(dest, source, NAME_MAX);
-  else
+  for (int node = 1; node < with->nnode; node++)
   {
-    PROFILE_BUG(strlen(source) >= MANGLE_MAX)
+    node_t *with_node = NODE(with, node);
 
-    strncpy(m, source, MANGLE_MAX);
-    
-    //remove vowels from the right
+    if (with_node->node_ticks_self <= 0) continue;
 
-    int n = strlen(m);
+    int ipath = 0;
 
-    while(n >= NAME_MAX)
+    for (int jnode = node; jnode > 0; jnode = NODE(with, jnode)->node_parent)
     {
-      //search for a vowel or underscore from the right
-
-      while(n >= 0)
+      if (ipath >= npath)
       {
-        //first vowels
+        npath = (npath == 0) ? NODE_CHUNK : 2 * npath;
+
+        PROFILE_BUG((path = realloc(path, npath * sizeof(int))) == NULL)
+      }
 
-        if ((m[n] == 'a') || (m[n] == 'o') or (m[n] == 'u') or
-            (m[n] == 'i') or (m[n] == 'e')) break;
-        
-        //then underscores
+      path[ipath++] = jnode;
+    }
 
-        if (m[n] == '_') break;
+    while(ipath-- > 0)
+    {
+      const char *name =
+        BLOCK(&(with->profile), NODE(with, path[ipath])->node_block_id)->block_name;
 
-        n--;
-      }
-      PROFILE_BUG(n < 0)
-      
-      //remove vowel
+      //spaces and semicolons separate the fields
 
-      while((m[n] = m[n + 1]) != '\0') n++;
+      for (const char *c = name; *c != '\0'; c++)
+        fputc(((*c == ' ') or (*c == ';')) ? '_' : *c, f);
+
+      if (ipath > 0) fputc(';', f);
     }
-    PROFILE_BUG(strlen(m) >= NAME_MAX)
 
-    strncpy(dest, m, NAME_MAX - 1);
+    fprintf(f, " %lld\n", with_node->node_ticks_self);
   }
+
+  free(path);
 }
 
-int new_block(int pid, const char *name, int *invocation_pointer)
+#endif
+
+void dump_profile(int pid, int verbose)
 {
-  PROFILE_BUG(PL.nblock >= BLOCK_MAX)
+  INTERNAL_BEGIN
+
+  char name[PROFILE_PATH_MAX];
 
-  int block_id = PL.nblock;
+  if (pid == 0)
+    snprintf(name, PROFILE_PATH_MAX, "%s.%s", profile_output, PROFILE_SUFFIX);
+  else
+    snprintf(name, PROFILE_PATH_MAX, "%s-%d.%s", profile_output, pid - 1,
+             PROFILE_SUFFIX);
 
-  block_t *with_block = PL.block + block_id;
+  fill_profile(&PL);
 
-  mangle(with_block->block_name, name);
+  output_profile(name, &(PL.profile), verbose);
 
-  with_block->block_name[NAME_MAX - 1] = '\0';
+#ifdef PROFILE_CCT
+  FILE *f;
 
-  with_block->block_invocation = *invocation_pointer;
+  if (pid == 0)
+    snprintf(name, PROFILE_PATH_MAX, "%s.folded", profile_output);
+  else
+    snprintf(name, PROFILE_PATH_MAX, "%s-%d.folded", profile_output, pid - 1);
 
-  with_block->block_invocation_pointer = invocation_pointer;
+  PROFILE_BUG((f = fopen(name, "w")) == NULL)
 
-  clear_block(with_block);
+  write_folded(f, &PL);
 
-  PL.nblock++;
+  fclose(f);
+#endif
 
-  return(block_id);
+  INTERNAL_END
 }
 
-local void update_mean_sigma(long long n, long long x,
-  double *mn, double *sn)
+//copy the blocks of the live profile of with to copy
+//the blocks of a thread with a pending reset are not copied
+
+local void copy_edges(profile_t *copy, edges_t *with_copy, edges_t *with_edges,
+  int nblock)
 {
-  double mnm1 = *mn;
-  double snm1 = *sn;
+  int nedge_max = __atomic_load_n(&(with_edges->nedge_max), __ATOMIC_ACQUIRE);
+  edge_t *edge = __atomic_load_n(&(with_edges->edge), __ATOMIC_ACQUIRE);
 
-  *mn = mnm1 + (x - mnm1) / n;
-  
-  *sn = snm1 + (x - mnm1) * (x - *mn);
-}
+  for (int iedge = 0; iedge < nedge_max; iedge++)
+  {
+    edge_t with_edge = edge[iedge];
 
-#define NCALIBRATION 2
+    if ((with_edge.edge_id < 0) or (with_edge.edge_id >= nblock)) continue;
+
+    edge_t *with_copy_edge = return_edge(copy, with_copy, with_edge.edge_id);
+
+    with_copy_edge->edge_calls = with_edge.edge_calls;
+    with_copy_edge->edge_time_total = with_edge.edge_time_total;
+    with_copy_edge->edge_time_off_total = with_edge.edge_time_off_total;
+  }
+}
 
-local long long counter_correction(int pid, long long counter_delta)
+local void copy_local(profile_t *copy, profile_local_t *with)
 {
-  PG.counter_pointer = &counter_dummy;
+  memset(copy, 0, sizeof(profile_t));
 
-  double mn = 0.0;
-  double sn = 0.0;
+  fill_header(copy, with);
 
-  for (long long n = 1; n <= NCALIBRATION; ++n)
+  if (__atomic_load_n(&(with->reset_seen), __ATOMIC_ACQUIRE) !=
+      __atomic_load_n(&profile_reset, __ATOMIC_ACQUIRE)) return;
+
+  profile_t *with_profile = &(with->profile);
+
+  copy->time_total = with_profile->time_total;
+
+  int nblock = __atomic_load_n(&(with_profile->nblock), __ATOMIC_ACQUIRE);
+
+  for (int iblock = 0; iblock < nblock; iblock++)
   {
-    counter_t counter_stamp;
-  
-    GET_COUNTER(&counter_stamp);
-    GET_COUNTER(PG.counter_pointer);
-  
-    update_mean_sigma(n, TICKS(counter_dummy) - TICKS(counter_stamp), &mn, &sn);
-  }
+    block_t *with_block = BLOCK(with_profile, iblock);
 
-  long long result = round(mn);
+    int block_id = add_block(copy);
 
-  result = counter_delta - result;
+    block_t *with_copy = BLOCK(copy, block_id);
 
-  if (result < 0) result = 0;
+    with_copy->block_name = with_block->block_name;
 
-  return(result);
-}
+    with_copy->block_invocation = with_block->block_invocation;
 
-void begin_block(int pid, int block_id)
-{
-  if (PL.nstack > 0)
-  {
-    stack_t *with_previous = PL.stack + PL.nstack - 1;
+    with_copy->block_address = with_block->block_address;
 
-    with_previous->stack_counter_end = PG.counter_stamp;
+    with_copy->block_calls = with_block->block_calls;
 
-    long long counter_delta = TICKS(with_previous->stack_counter_end) -
-                              TICKS(with_previous->stack_counter_begin);
+    with_copy->block_time_self_total = with_block->block_time_self_total;
+    with_copy->block_time_total = with_block->block_time_total;
 
-    with_previous->stack_time_self +=
-      SECS(counter_correction(pid, counter_delta));
-  }
-  else
-  {
-    GET_COUNTER(&(PL.counter_overhead_begin));
-  }
-  PROFILE_BUG(PL.nstack >= STACK_MAX)
+    *(with_copy->block_self_histogram) = *(with_block->block_self_histogram);
+    *(with_copy->block_total_histogram) = *(with_block->block_total_histogram);
 
-  stack_t *with_current = PL.stack + PL.nstack;
+    for (int iperf = 0; iperf < NPERF; iperf++)
+    {
+      with_copy->block_perf_self[iperf] = with_block->block_perf_self[iperf];
+      with_copy->block_perf_total[iperf] = with_block->block_perf_total[iperf];
+    }
 
-  with_current->stack_id = block_id;
+    with_copy->block_time_off_self = with_block->block_time_off_self;
+    with_copy->block_time_off_total = with_block->block_time_off_total;
 
-  with_current->stack_time_self = 0.0;
+    with_copy->block_mallocs_self = with_block->block_mallocs_self;
+    with_copy->block_malloc_bytes_self = with_block->block_malloc_bytes_self;
+    with_copy->block_frees_self = with_block->block_frees_self;
+    with_copy->block_mallocs_total = with_block->block_mallocs_total;
+    with_copy->block_malloc_bytes_total = with_block->block_malloc_bytes_total;
 
-  with_current->stack_time_total = 0.0;
+    for (int idepth = 0; idepth < NDEPTH; idepth++)
+      with_copy->block_depth_calls[idepth] = with_block->block_depth_calls[idepth];
 
-  PG.counter_pointer = &(with_current->stack_counter_begin);
+    with_copy->block_calls_deinstrumented = with_block->block_calls_deinstrumented;
+    with_copy->block_calls_outermost_deinstrumented =
+      with_block->block_calls_outermost_deinstrumented;
 
-  PL.nstack++;
+    copy_edges(copy, &(with_copy->block_parents), &(with_block->block_parents),
+               nblock);
+    copy_edges(copy, &(with_copy->block_children), &(with_block->block_children),
+               nblock);
+  }
+
+#ifdef PROFILE_FUNCTIONS
+  resolve_names(copy);
+#endif
 }
 
-void end_block(int pid)
+//copy the profile of with if it was not updated during the copy
+
+local int read_local(profile_t *copy, profile_local_t *with)
 {
-  PL.nstack--;
+  unsigned int sequence = __atomic_load_n(&(with->sequence), __ATOMIC_ACQUIRE);
 
-  PROFILE_BUG(PL.nstack < 0)
+  if ((sequence & 1) != 0) return(FALSE);
 
-  stack_t *with_current = PL.stack + PL.nstack;
+  copy_local(copy, with);
 
-  with_current->stack_counter_end = PG.counter_stamp;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
 
-  long long counter_delta = TICKS(with_current->stack_counter_end) -
-                            TICKS(with_current->stack_counter_begin);
+  if (__atomic_load_n(&(with->sequence), __ATOMIC_RELAXED) == sequence)
+    return(TRUE);
 
-  with_current->stack_time_self +=
-    SECS(counter_correction(pid, counter_delta));
+  free_profile(copy);
 
-  with_current->stack_time_total += with_current->stack_time_self;
+  return(FALSE);
+}
 
-  block_t *with_block = PL.block + with_current->stack_id;
+//the resets and copy requests are served by the thread itself in end_block
 
-  with_block->block_calls++;
+local void serve_request(void)
+{
+  PL.request_seen = __atomic_load_n(&profile_request, __ATOMIC_ACQUIRE);
 
-  with_block->block_time_self_total += with_current->stack_time_self;
+  int reset = __atomic_load_n(&profile_reset, __ATOMIC_ACQUIRE);
 
-  with_block->block_time_total += with_current->stack_time_total;
+  if (PL.reset_seen != reset)
+  {
+    write_begin(&PL);
 
-  (*with_block->block_invocation_pointer)--;
+    for (int iblock = 0; iblock < PL.profile.nblock; iblock++)
+      clear_block(BLOCK(&(PL.profile), iblock));
 
-  PROFILE_BUG(*with_block->block_invocation_pointer < 0);
+#ifdef PROFILE_CCT
+    //the frames on the stack refer to their nodes, so the nodes are kept
+
+    for (int node = 0; node < PL.nnode; node++)
+    {
+      node_t *with_node = NODE(&PL, node);
 
-  PG.counter_pointer = &counter_dummy;
+      with_node->node_calls = 0;
+      with_node->node_ticks_self = 0;
+      with_node->node_ticks_total = 0;
+    }
+#endif
 
-  if (PL.nstack > 0)
-  {
-    stack_t *with_previous = PL.stack + (PL.nstack - 1);
+    PL.profile.time_total = 0.0;
 
-    with_previous->stack_time_total += with_current->stack_time_total;
+    __atomic_store_n(&(PL.reset_seen), reset, __ATOMIC_RELEASE);
 
-    PG.counter_pointer = &(with_previous->stack_counter_begin);
+    write_end(&PL);
 
-    //update parent in child
+#ifdef PROFILE_SHM
+    reset_shm();
+#endif
 
-    parent_t *with_parent = PL.block[with_current->stack_id].block_parent +
-                            with_previous->stack_id;
+#ifdef PROFILE_SAMPLE
+    //the mean times are gone, so the next call of every block is sampled
 
-    with_parent->parent_active = TRUE;
+    for (int ichunk = 0; ichunk < PROFILE_CHUNK_MAX; ichunk++)
+    {
+      profile_static_t *chunk = profile_static_chunk[ichunk];
 
-    with_parent->parent_calls++;
+      if (chunk == NULL) continue;
 
-    //update child in parent
+      for (int isite = 0; isite < (PROFILE_STATIC_CHUNK << ichunk); isite++)
+        chunk[isite].block_sample = 0;
+    }
 
-    child_t *with_child = PL.block[with_previous->stack_id].block_child +
-                          with_current->stack_id;
+#ifdef PROFILE_REGISTER
+    for (int isite = 0; isite < nsite_all; isite++)
+      profile_static_site[isite].block_sample = 0;
+#endif
 
-    with_child->child_active = TRUE;
+#ifdef PROFILE_FUNCTIONS
+    for (int ichunk = 0; ichunk < PROFILE_CHUNK_MAX; ichunk++)
+    {
+      profile_static_t *chunk = PL.function_chunk[ichunk];
 
-    with_child->child_calls++;
+      if (chunk == NULL) continue;
 
-    with_child->child_time_total += with_current->stack_time_total;
+      for (int isite = 0; isite < (FUNCTION_CHUNK << ichunk); isite++)
+        chunk[isite].block_sample = 0;
+    }
+#endif
+#endif
   }
-  else
+
+  int state = COPY_REQUESTED;
+
+  if (__atomic_compare_exchange_n(&(PL.copy_state), &state, COPY_COPYING,
+                                  FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
   {
-    GET_COUNTER(&(PL.counter_overhead_end));
- 
-    counter_delta = TICKS(PL.counter_overhead_end) -
-                    TICKS(PL.counter_overhead_begin);
+    copy_local(&(PL.copy), &PL);
 
-    PL.time_total += SECS(counter_delta);
+    __atomic_store_n(&(PL.copy_state), COPY_DONE, __ATOMIC_RELEASE);
   }
 }
 
-#define NVALIDATE 100000LL
+//a thread that updates its profile all the time is asked to copy its
+//profile itself after NSNAPSHOT_TRY failed attempts
+
+#define NSNAPSHOT_TRY 16
 
-local void validate_counter_correction(void)
+#define SNAPSHOT_NSECS 1000000L
+
+local void snapshot_local(profile_t *copy, profile_local_t *with)
 {
-  BEGIN_BLOCK("main")
+  for (int itry = 0; itry < NSNAPSHOT_TRY; itry++)
+    if (read_local(copy, with)) return;
 
-  for (long long n = 1; n <= NVALIDATE; ++n)
-  {
-    BEGIN_BLOCK("profile-0-0")
-    END_BLOCK
-  
-    BEGIN_BLOCK("profile-1-1")
-      BEGIN_BLOCK("profile-1-1-0")
-      END_BLOCK
-    END_BLOCK
-  
-    BEGIN_BLOCK("profile-2-2")
-      BEGIN_BLOCK("profile-2-2-1-0")
-      END_BLOCK
-      BEGIN_BLOCK("profile-2-2-2-0")
-      END_BLOCK
-    END_BLOCK
-  
-    BEGIN_BLOCK("profile-3-1")
-      BEGIN_BLOCK("profile-3-3-1-3")
-        BEGIN_BLOCK("profile-3-3-1-3-1-0")
-        END_BLOCK
-        BEGIN_BLOCK("profile-3-3-1-3-2-0")
-        END_BLOCK
-        BEGIN_BLOCK("profile-3-3-1-3-3-0")
-        END_BLOCK
-      END_BLOCK
-    END_BLOCK
-  }
-  END_BLOCK
-  DUMP_PROFILE(1)
-  exit(0);
-}
+  __atomic_store_n(&(with->copy_state), COPY_REQUESTED, __ATOMIC_RELEASE);
 
-#define NCALL 1000000LL
+  __atomic_add_fetch(&profile_request, 1, __ATOMIC_ACQ_REL);
 
-void init_profile(void)
-{
-  PROFILE_BUG(pthread_mutex_init(&profile_mutex, NULL) != 0)
+  struct timespec interval = {0, SNAPSHOT_NSECS};
 
-  for (int ithread = 0; ithread < THREAD_MAX; ithread++)
+  while(TRUE)
   {
-    tids[ithread] = PROFILE_INVALID;
+    int state = __atomic_load_n(&(with->copy_state), __ATOMIC_ACQUIRE);
 
-    profile_local_t *with = profile_local + ithread;
+    if (state == COPY_DONE)
+    {
+      *copy = with->copy;
 
-    with->nblock = 0;
+      memset(&(with->copy), 0, sizeof(profile_t));
 
-    with->nstack = 0;
+      __atomic_store_n(&(with->copy_state), COPY_NONE, __ATOMIC_RELEASE);
 
-    with->time_total = 0.0;
-  }
+      return;
+    }
 
-  (void) remove("profile.txt");
-  for (int ithread = 0; ithread < THREAD_MAX; ithread++)
-  {
-    char name[NAME_MAX];
+    //the thread may have become idle, for example blocked in a system call
 
-    snprintf(name, NAME_MAX, "profile-%d.txt", ithread);
-    (void) remove(name);
-  }
+    if ((state == COPY_REQUESTED) && read_local(copy, with))
+    {
+      if (__atomic_compare_exchange_n(&(with->copy_state), &state, COPY_NONE,
+                                      FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return;
 
-  frequency = 1000000000;
+      //the thread started copying after all
 
-  int pid = PID;
-  PG.counter_pointer = &counter_dummy;
-  
-  double mn = 0.0;
-  double sn = 0.0;
+      free_profile(copy);
+    }
 
-  for (long long n = 1; n <= NCALL; ++n)
-  {
-    counter_t counter_stamp;
-  
-    GET_COUNTER(&counter_stamp);
-    GET_COUNTER(PG.counter_pointer);
-  
-    update_mean_sigma(n, TICKS(counter_dummy) - TICKS(counter_stamp), &mn, &sn);
+    nanosleep(&interval, NULL);
   }
-  counter_mean = round(mn);
-  counter_sigma = round(mn / 3.0);
+}
 
-  ncounter_largest = 0;
-  counter_largest = 0;
+//the counters of all threads are reset, every thread resets its own
+//counters at its next END_BLOCK, calls that are in progress are counted
+//when they end
 
-  for (long long n = 1; n <= NCALL; ++n)
-  {
-    counter_t counter_stamp;
-  
-    GET_COUNTER(&counter_stamp);
-    GET_COUNTER(PG.counter_pointer);
+local void request_reset(void)
+{
+  __atomic_add_fetch(&profile_reset, 1, __ATOMIC_ACQ_REL);
 
-    long long delta = TICKS(counter_dummy) - TICKS(counter_stamp);
+  __atomic_add_fetch(&profile_request, 1, __ATOMIC_ACQ_REL);
 
-    if (delta > (counter_mean + 3 * counter_sigma))
-    {
-      ++ncounter_largest;
-      counter_largest = delta;
-    }
-  }
-  //validate_counter_correction();
+  if (profile_pid != PROFILE_INVALID) serve_request();
 }
 
-void dump_profile(int pid, int verbose)
+void clear_profile(void)
 {
-  char name[NAME_MAX];
-  FILE *f;
+  INTERNAL_BEGIN
 
-  if (pid == 0)
-    strncpy(name, "profile.txt", NAME_MAX);
-  else
-    snprintf(name, NAME_MAX, "profile-%d.txt", pid - 1);
+  pthread_mutex_lock(&snapshot_mutex);
 
-  PROFILE_BUG((f = fopen(name, "w")) == NULL)
+  clear_retired();
 
-  {
-    char stamp[NAME_MAX];
-    time_t t = time(NULL);
+  pthread_mutex_unlock(&snapshot_mutex);
 
-    (void) strftime(stamp, NAME_MAX, "%H:%M:%S-%d/%m/%Y", localtime(&t));
+  request_reset();
 
-    fprintf(f, "# Profile dumped at %s\n", stamp);
-  }
+  INTERNAL_END
+}
 
-  fprintf(f, "# The frequency is %llu ticks, or %.10f secs/tick.\n",
-    frequency, 1.0/frequency);
-  fprintf(f, "# The intrinsic profile overhead is %lld ticks on average.\n",
-    counter_mean);
-  fprintf(f, "# %lld out of %lld samples of the intrinsic profile overhead\n"
-             "# ..are larger than twice the mean, the largest value is %lld.\n",
-             ncounter_largest, NCALL, counter_largest);
+//merge copies of the profiles of all threads and of the retired threads,
+//called with snapshot_mutex taken, which also keeps nthread and the slots
+//from changing, so profile_mutex is not needed
 
-  fprintf(f, "# The total number of blocks is %d.\n", PL.nblock);
+local void merge_threads(profile_t *merged)
+{
+  memset(merged, 0, sizeof(profile_t));
 
-  if (PL.nstack > 0)
+  for (int pid = 0; pid < nthread; pid++)
   {
-    fprintf(f, "# The following blocks are not properly terminated by an END_BLOCK!\n");
+    profile_local_t *with = CHUNK_ENTRY(profile_local_chunk, pid, THREAD_CHUNK);
 
-    for (int istack = 0; istack < PL.nstack; istack++)
-    {
-      block_t *with_block = PL.block + PL.stack[istack].stack_id;
+    if (!with->in_use) continue;
 
-      fprintf(f, "%s (invocation %d)\n",
-        with_block->block_name,with_block->block_invocation);
-    }
-    fprintf(f, "\n");
-  }
+    profile_t copy;
 
-  //total time
+    pthread_mutex_lock(&copy_mutex);
 
-  double time_self_total = 0.0;
+    snapshot_local(&copy, with);
 
-  block_t *with_main = NULL;
-  block_t *with_main_thread = NULL;
+    pthread_mutex_unlock(&copy_mutex);
 
-  for (int iblock = 0; iblock < PL.nblock; iblock++)
-  {
-    block_t *with_block = PL.block + iblock;
+    merge_profile(merged, &copy);
 
-    if (strcmp(with_block->block_name, "main") == 0)
-      with_main = with_block;
-    if (strcmp(with_block->block_name, "main-thread") == 0)
-      with_main_thread = with_block;
+    free_profile(&copy);
+  }
 
-    with_block->block_child_calls = 0;
+  if (retired_local.profile.nmerged > 0)
+    merge_profile(merged, &(retired_local.profile));
+}
 
-    with_block->block_child_time_total = 0.0;
+//write the merged profiles of all threads to profile-snapshot-<n>.txt
+//(or .gwp) while the threads keep running, optionally reset the counters
 
-    for (int jblock = 0; jblock < BLOCK_MAX; jblock++)
-    {
-      child_t *with_child = with_block->block_child + jblock;
+void snapshot_profile(int verbose, int reset)
+{
+  INTERNAL_BEGIN
 
-      if (!with_child->child_active) continue;
+  pthread_mutex_lock(&snapshot_mutex);
 
-      with_block->block_child_calls += with_child->child_calls;
+  profile_t merged;
 
-      with_block->block_child_time_total += with_child->child_time_total;
-    }
+  merge_threads(&merged);
+
+  if (reset)
+  {
+    clear_retired();
 
-    time_self_total += with_block->block_time_self_total;
+    request_reset();
   }
 
-  //main-thread takes precedence
+  char name[PROFILE_PATH_MAX];
 
-  if (with_main_thread != NULL) with_main = with_main_thread;
+  snprintf(name, PROFILE_PATH_MAX, "%s-snapshot-%d.%s", profile_output,
+           nsnapshot++, PROFILE_SUFFIX);
 
-  if (with_main == NULL)
-  {
-    fprintf(stderr, "block main or main-thread not found\n");
-    exit(EXIT_FAILURE);
-  }
+  output_profile(name, &merged, verbose);
 
-  fprintf(f, "# The total run time was %.10f secs.\n", PL.time_total);
+  free_profile(&merged);
 
-  fprintf(f, "# The total self time was %.10f secs.\n", time_self_total);
+  pthread_mutex_unlock(&snapshot_mutex);
+
+  INTERNAL_END
+}
 
-  fprintf(f, "# The total profile overhead was %.10f secs.\n",
-    PL.time_total - time_self_total);
+//copy the profile of the thread with sequence number pid, or the merged
+//profiles of all threads if pid is PROFILE_INVALID, to with while the
+//threads keep running
+//with is a merged profile, so its blocks can be looked up with find_block,
+//it is empty if the thread does not exist or has exited
+//the caller frees with with free_profile
+//the slots of the threads are pinned with snapshot_mutex taken and copied
+//without, so new threads and snapshots do not wait for a busy thread to
+//copy its profile, a thread that exits waits until its pinned slot is
+//copied, so it is never both copied and merged into the retired threads
+
+void query_profile(profile_t *with, int pid)
+{
+  INTERNAL_BEGIN
 
-  fprintf(f, "\n");
+  memset(with, 0, sizeof(profile_t));
 
-  //sort by straight insertion
+  pthread_mutex_lock(&snapshot_mutex);
 
-  int sort[BLOCK_MAX];
+  int npinned = 0;
+  int *pinned;
 
-  for (int iblock = 0; iblock < PL.nblock; iblock++)
-    sort[iblock] = iblock;
+  PROFILE_BUG((pinned = malloc((nthread + 1) * sizeof(int))) == NULL)
 
-  for (int iblock = 0; iblock < PL.nblock - 1; iblock++)
+  for (int ipid = 0; ipid < nthread; ipid++)
   {
-    int kblock = iblock;
+    if ((pid != PROFILE_INVALID) && (ipid != pid)) continue;
 
-    for (int jblock = iblock + 1; jblock < PL.nblock; jblock++)
-    {
-      if (PL.block[sort[jblock]].block_time_total >
-          PL.block[sort[kblock]].block_time_total) kblock = jblock;
-    }
+    profile_local_t *with_local =
+      CHUNK_ENTRY(profile_local_chunk, ipid, THREAD_CHUNK);
 
-    int t = sort[iblock];
-    sort[iblock] = sort[kblock];
-    sort[kblock] = t;
-  }
+    //a thread that exits is not pinned, it can be missing from the query
+    //until it is merged into the retired threads
 
-  fprintf(f, "# Blocks sorted by total time spent in block and children.\n");
+    if (!with_local->in_use or with_local->retiring) continue;
 
-  fprintf(f, "# The sum of total times (or the sum of the percentages)\n");
+    __atomic_add_fetch(&(with_local->readers), 1, __ATOMIC_ACQ_REL);
 
-  fprintf(f, "# does not have any meaning, since children will be double counted.\n");
+    pinned[npinned++] = ipid;
+  }
+
+  if ((pid == PROFILE_INVALID) && (retired_local.profile.nmerged > 0))
+    merge_profile(with, &(retired_local.profile));
 
-  fprintf(f, "%-32s %-10s %6s %16s %10s\n", 
-    "name", "invocation", "perc", "total time", "calls");
+  pthread_mutex_unlock(&snapshot_mutex);
 
-  for (int iblock = 0; iblock < PL.nblock; iblock++)
+  for (int ipinned = 0; ipinned < npinned; ipinned++)
   {
-    block_t *with_block = PL.block + sort[iblock];
+    profile_local_t *with_local =
+      CHUNK_ENTRY(profile_local_chunk, pinned[ipinned], THREAD_CHUNK);
 
-    fprintf(f, "%-32s %-10d %6.2f %16.10f %10lld\n",
-      with_block->block_name, with_block->block_invocation,
-      PERC(with_block->block_time_total),
-      with_block->block_time_total,
-      with_block->block_calls);
-  }
-  fprintf(f, "\n");
+    profile_t copy;
 
-  //sort by straight insertion
+    pthread_mutex_lock(&copy_mutex);
 
-  for (int iblock = 0; iblock < PL.nblock; iblock++)
-    sort[iblock] = iblock;
+    snapshot_local(&copy, with_local);
 
-  for (int iblock = 0; iblock < PL.nblock - 1; iblock++)
-  {
-    int kblock = iblock;
+    pthread_mutex_unlock(&copy_mutex);
 
-    for (int jblock = iblock + 1; jblock < PL.nblock; jblock++)
-    {
-      if (PL.block[sort[jblock]].block_time_self_total >
-          PL.block[sort[kblock]].block_time_self_total) kblock = jblock;
-    }
+    __atomic_sub_fetch(&(with_local->readers), 1, __ATOMIC_RELEASE);
 
-    int t = sort[iblock];
-    sort[iblock] = sort[kblock];
-    sort[kblock] = t;
+    merge_profile(with, &copy);
+
+    free_profile(&copy);
   }
 
-  fprintf(f, "# Blocks sorted by total time spent in own code.\n");
+  free(pinned);
+
+  INTERNAL_END
+}
 
-  fprintf(f, "# The sum of the self times is equal to the total self time.\n");
+#ifdef PROFILE_SNAPSHOT_SIGNAL
 
-  fprintf(f, "%-32s %-10s %6s %16s %10s\n", 
-    "name", "invocation", "perc", "self time", "calls");
+//the signal handler only posts a semaphore, the snapshots are written by
+//the snapshot thread
 
-  for (int iblock = 0; iblock < PL.nblock; iblock++)
-  {
-    block_t *with_block = PL.block + sort[iblock];
+local sem_t snapshot_semaphore;
 
-    fprintf(f, "%-32s %-10d %6.2f %16.10f %10lld\n",
-      with_block->block_name, with_block->block_invocation,
-      PERC(with_block->block_time_self_total),
-      with_block->block_time_self_total,
-      with_block->block_calls);
-  }
-  fprintf(f, "\n");
+local void snapshot_handler(int signal_number)
+{
+  (void) signal_number;
+
+  (void) sem_post(&snapshot_semaphore);
+}
+
+local void *snapshotter(void *arg)
+{
+  (void) arg;
 
-  for (int iblock = 0; iblock < PL.nblock; iblock++)
+  while(TRUE)
   {
-    PL.block[iblock].block_time_recursive_total = 0.0;
+    if (sem_wait(&snapshot_semaphore) == 0) snapshot_profile(0, FALSE);
+  }
 
-    PL.block[iblock].block_calls_recursive_total = 0;
+  return(NULL);
+}
 
-    if (PL.block[iblock].block_invocation == 1)
-    {
-      PL.block[iblock].block_time_recursive_total =
-        PL.block[iblock].block_time_self_total;
+local void start_snapshot(void)
+{
+  PROFILE_BUG(sem_init(&snapshot_semaphore, 0, 0) != 0)
 
-      PL.block[iblock].block_calls_recursive_total =
-        PL.block[iblock].block_calls;
+  pthread_t snapshot_thread;
 
-      for (int jblock = 0; jblock < PL.nblock; jblock++)
-      {
-        if (PL.block[jblock].block_invocation == 1) continue;
+  PROFILE_BUG(pthread_create(&snapshot_thread, NULL, snapshotter, NULL) != 0)
 
-        if (strcmp(PL.block[iblock].block_name,
-                   PL.block[jblock].block_name) == 0)
-        {
-          PL.block[iblock].block_time_recursive_total +=
-            PL.block[jblock].block_time_self_total;
+  PROFILE_BUG(pthread_detach(snapshot_thread) != 0)
 
-          PL.block[iblock].block_calls_recursive_total +=
-            PL.block[jblock].block_calls;
-        }
-      }
-    }
-  }
+  struct sigaction action;
 
-  //sort by straight insertion
+  memset(&action, 0, sizeof(action));
 
-  for (int iblock = 0; iblock < PL.nblock; iblock++)
-    sort[iblock] = iblock;
+  action.sa_handler = snapshot_handler;
 
-  for (int iblock = 0; iblock < PL.nblock - 1; iblock++)
-  {
-    int kblock = iblock;
+  sigemptyset(&action.sa_mask);
 
-    for (int jblock = iblock + 1; jblock < PL.nblock; jblock++)
-    {
-      if (PL.block[sort[jblock]].block_time_recursive_total >
-          PL.block[sort[kblock]].block_time_recursive_total) kblock = jblock;
-    }
+  action.sa_flags = SA_RESTART;
 
-    int t = sort[iblock];
-    sort[iblock] = sort[kblock];
-    sort[kblock] = t;
-  }
+  PROFILE_BUG(sigaction(PROFILE_SNAPSHOT_SIGNAL, &action, NULL) != 0)
+}
 
-  fprintf(f, "# Blocks sorted by self times summed over recursive invocations.\n");
+#endif
 
-  fprintf(f, "%-32s %6s %6s %16s %10s %16s %10s\n",
-    "name", "perc", "%main", "self time", "calls", "self time/call", "ticks/call");
+//the other threads should have finished or should not be in a block
 
-  for (int iblock = 0; iblock < PL.nblock; iblock++)
-  {
-    int jblock = sort[iblock];
+void dump_profile_all(int verbose)
+{
+  INTERNAL_BEGIN
 
-    if (PL.block[jblock].block_invocation == 1)
-    {
-      double self_time_per_call = 
-        PL.block[jblock].block_time_recursive_total / 
-        PL.block[jblock].block_calls_recursive_total;
-      long long ticks_per_call = -1;
-      if (self_time_per_call < 1.0)
-        ticks_per_call = round(self_time_per_call * frequency);
-
-      fprintf(f, "%-32s %6.2f %6.2f %16.10f %10lld %16.10f %10lld\n",
-        PL.block[jblock].block_name,
-        PERC(PL.block[jblock].block_time_recursive_total),
-        PL.block[jblock].block_time_recursive_total / with_main->block_time_total * 100,
-        PL.block[jblock].block_time_recursive_total,
-        PL.block[jblock].block_calls_recursive_total,
-        self_time_per_call,
-        ticks_per_call);
-    }
-  }
-  fprintf(f, "\n");
+  profile_t merged;
 
-  if (verbose == 0) goto label_return;
+  memset(&merged, 0, sizeof(profile_t));
 
-  for (int iblock = 0; iblock < PL.nblock; iblock++)
-  {
-    block_t *with_block = PL.block + sort[iblock];
+  //threads that exit wait until the profiles are dumped
 
-    fprintf(f, "# Summary for block %s, invocation %d.\n",
-      with_block->block_name, with_block->block_invocation);
+  pthread_mutex_lock(&snapshot_mutex);
 
-    fprintf(f, "Spends %.10f secs in %lld call(s), or %.2f%% of total execution time.\n",
-      with_block->block_time_total,
-      with_block->block_calls,
-      PERC(with_block->block_time_total));
+  pthread_mutex_lock(&profile_mutex);
 
-    fprintf(f, "Spends %.10f secs (%.2f%%) in own code, %.10f secs (%.2f%%) in children.\n",
-      with_block->block_time_self_total, PERC(with_block->block_time_self_total),
-      with_block->block_child_time_total, PERC(with_block->block_child_time_total));
-    fprintf(f, "\n");
+  int nmerged = nthread;
 
-    int found = FALSE;
+  pthread_mutex_unlock(&profile_mutex);
 
-    for (int jblock = 0; jblock < BLOCK_MAX; jblock++)
-    {
-      child_t *with_child = with_block->block_child + jblock;
+  for (int pid = 0; pid < nmerged; pid++)
+  {
+    profile_local_t *with = CHUNK_ENTRY(profile_local_chunk, pid, THREAD_CHUNK);
 
-      if (!with_child->child_active) continue;
+    if (!with->in_use) continue;
 
-      found = TRUE;
+    fill_profile(with);
 
-      fprintf(f, "Spends %.10f secs in %lld call(s) to %s, invocation %d.\n",
-        with_child->child_time_total,
-        with_child->child_calls,
-        PL.block[jblock].block_name,
-        PL.block[jblock].block_invocation);
-    }
+    merge_profile(&merged, &(with->profile));
+  }
 
-    if (!found) fprintf(f, "No children were found.\n");
+  if (retired_local.profile.nmerged > 0)
+    merge_profile(&merged, &(retired_local.profile));
 
-    found = FALSE;
+  char name[PROFILE_PATH_MAX];
 
-    for (int jblock = 0; jblock < BLOCK_MAX; jblock++)
-    {
-      parent_t *with_parent = with_block->block_parent + jblock;
+  snprintf(name, PROFILE_PATH_MAX, "%s-all.%s", profile_output, PROFILE_SUFFIX);
 
-      if (!with_parent->parent_active) continue;
+  output_profile(name, &merged, verbose);
 
-      found = TRUE;
+  free_profile(&merged);
 
-      fprintf(f, "Is called %lld time(s) from %s, invocation %d.\n",
-        with_parent->parent_calls,
-        PL.block[jblock].block_name, PL.block[jblock].block_invocation);
-    }
+#ifdef PROFILE_CCT
+  //flame graph tools sum the ticks of equal call paths
 
-    if (!found) fprintf(f, "No parents were found\n");
+  FILE *f;
 
-    fprintf(f, "\n");
-  }
+  snprintf(name, PROFILE_PATH_MAX, "%s-all.folded", profile_output);
+
+  PROFILE_BUG((f = fopen(name, "w")) == NULL)
 
-  label_return:
+  for (int pid = 0; pid < nmerged; pid++)
+  {
+    profile_local_t *with = CHUNK_ENTRY(profile_local_chunk, pid, THREAD_CHUNK);
 
-  fprintf(f, "# End of profile.\n");
+    if (with->in_use) write_folded(f, with);
+  }
 
-  fclose(f);
-}
+  write_folded(f, &retired_local);
 
+  fclose(f);
 #endif
 
+  pthread_mutex_unlock(&snapshot_mutex);
+
+  INTERNAL_END
+}
 
+#endif
@@ -2,61 +2,328 @@
 //SCU REVISION 0.589 ma 25 apr 2022  9:43:39 CEST
 #define ProfileH
 
+#define PROFILE_INVALID (-1)
+
+//growable tables are split in chunks that are never moved,
+//chunk K holds M << K entries, so PROFILE_CHUNK_MAX chunks cover any int index
+
+#define PROFILE_CHUNK_MAX 32
+
+#define PROFILE_CHUNK(I, M)     (31 - __builtin_clz((unsigned int) (I) / (M) + 1))
+#define PROFILE_OFFSET(I, M, K) ((I) - (M) * ((1 << (K)) - 1))
+
+//per-thread state is aligned to cache lines so that threads never write
+//to the same cache line
+
+#define PROFILE_CACHE_LINE 64
+
 #ifdef PROFILE
 
+//automatic de-instrumentation, compile with -DPROFILE_DEINSTRUMENT=<M>
+//the calls of a site whose mean total time per call is less than M times the
+//intrinsic profile overhead after PROFILE_DEINSTRUMENT_CALLS timed calls are
+//only counted, their time stays in the self time of the caller
+//the counted calls take the path of the calls that are not sampled, so
+//without -DPROFILE_SAMPLE every call is sampled
+
+#if defined(PROFILE_DEINSTRUMENT) && !defined(PROFILE_SAMPLE)
+#define PROFILE_SAMPLE 1
+#endif
+
+#ifndef PROFILE_DEINSTRUMENT_CALLS
+#define PROFILE_DEINSTRUMENT_CALLS 1000
+#endif
+
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/syscall.h>  
 
-#define PROFILE_INVALID (-1)
-#define THREAD_MAX      16
-#define RECURSE_MAX     100
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//the logical thread id is cached in thread-local storage, so only the
+//first block of a thread needs the syscall and the mutex in return_pid
 
-#define PID return_pid(syscall(SYS_gettid))
+#define PID (profile_pid != PROFILE_INVALID ? profile_pid :\
+  return_pid(syscall(SYS_gettid)))
 
-#define PG profile_global[pid]
-#define PS profile_static[pid]
+#define PG profile_global
+#define PS (*profile_static)
+
+//counter backends, select one with -DPROFILE_COUNTER=<backend>
+//PROFILE_COUNTER_THREAD    thread CPU time (default), not accelerated by the vDSO
+//PROFILE_COUNTER_MONOTONIC wall-clock time through the vDSO
+//PROFILE_COUNTER_TSC       time stamp counter (rdtsc), needs an invariant TSC
+//PROFILE_COUNTER_TSCP      time stamp counter (rdtscp), waits for preceding instructions
+
+#define PROFILE_COUNTER_THREAD    1
+#define PROFILE_COUNTER_MONOTONIC 2
+#define PROFILE_COUNTER_TSC       3
+#define PROFILE_COUNTER_TSCP      4
+
+#ifndef PROFILE_COUNTER
+#define PROFILE_COUNTER PROFILE_COUNTER_THREAD
+#endif
+
+#if (PROFILE_COUNTER == PROFILE_COUNTER_THREAD) || \
+    (PROFILE_COUNTER == PROFILE_COUNTER_MONOTONIC)
+
+#include <time.h>
 
 typedef struct timespec counter_t;
 
+#if PROFILE_COUNTER == PROFILE_COUNTER_THREAD
+#define PROFILE_COUNTER_NAME "thread-cputime"
+#define GET_COUNTER(P) clock_gettime(CLOCK_THREAD_CPUTIME_ID, P)
+#else
+#define PROFILE_COUNTER_NAME "monotonic"
+#define GET_COUNTER(P) clock_gettime(CLOCK_MONOTONIC, P)
+#endif
+
+#define TICKS(TV) ((TV).tv_sec * 1000000000LL + (TV).tv_nsec)
+
+#elif (PROFILE_COUNTER == PROFILE_COUNTER_TSC) || \
+      (PROFILE_COUNTER == PROFILE_COUNTER_TSCP)
+
+#if !defined(__x86_64__) && !defined(__i386__)
+#error "the TSC counter backends need an x86 processor"
+#endif
+
+#include <x86intrin.h>
+
+typedef unsigned long long counter_t;
+
+#if PROFILE_COUNTER == PROFILE_COUNTER_TSC
+#define PROFILE_COUNTER_NAME "tsc"
+#define GET_COUNTER(P) (*(P) = __rdtsc())
+#else
+#define PROFILE_COUNTER_NAME "tscp"
+
+static inline __attribute__((no_instrument_function))
+unsigned long long profile_rdtscp(void)
+{
+  unsigned int aux;
+
+  return(__rdtscp(&aux));
+}
+
+#define GET_COUNTER(P) (*(P) = profile_rdtscp())
+#endif
+
+#define TICKS(TV) ((long long) (TV))
+
+#else
+#error "unknown PROFILE_COUNTER"
+#endif
+
+//counter_dummy receives the counter when no block is active
+//unsampled is the number of calls on the stack that are not sampled
+
 typedef struct
 {
   counter_t counter_stamp;
   counter_t *counter_pointer;
-} profile_global_t;
+  counter_t counter_dummy;
+#ifdef PROFILE_SAMPLE
+  int unsampled;
+#endif
+} __attribute__((aligned(PROFILE_CACHE_LINE))) profile_global_t;
+
+//the state of a BEGIN_BLOCK site in a thread
+//block_id[invocation] is the block of the recursive invocation of the site,
+//block_id always has room for one invocation more than the deepest
+//invocation seen so far, so BEGIN_BLOCK only has to check for PROFILE_INVALID
+//block_sample counts down the calls to the next sampled call
 
 typedef struct
 {
-  int block_id[RECURSE_MAX];
-  int block_init;
+  int *block_id;
+  int nblock_id;
   int block_invocation;
+#ifdef PROFILE_SAMPLE
+  int block_sample;
+#endif
 } profile_static_t;
 
-extern profile_global_t profile_global[THREAD_MAX];
+#define PROFILE_STATIC_CHUNK 64
+
+//the block of the current invocation of a site
+//with -DPROFILE_FLAT_RECURSION all the recursive invocations of a site share
+//the block of the first invocation, so block_id has room for one invocation
+
+#ifdef PROFILE_FLAT_RECURSION
+#define PROFILE_BLOCK_ID PS.block_id[1]
+#else
+#define PROFILE_BLOCK_ID PS.block_id[PS.block_invocation]
+#endif
+
+extern __thread profile_global_t profile_global;
+
+extern __thread int profile_pid;
+
+extern __thread profile_static_t *profile_static_chunk[PROFILE_CHUNK_MAX];
+
+#ifdef PROFILE_REGISTER
+
+//sites registered at load time, compile with -DPROFILE_REGISTER
+//in C every BEGIN_BLOCK puts the pointer to its name in the section
+//gwp_sites, the id of the site is the index of the pointer in the section,
+//so it is known when the program is linked
+//in C++ the static data member of a template instantiated for every site
+//is initialized with register_site before main, since the statics of inline
+//functions and templates cannot be put in a named section
+//the state of the sites of a thread is an array indexed by the site id
+//that is allocated when the thread is registered
+//the blocks are still created at the first call of every invocation of a
+//site, so BEGIN_BLOCK still checks PROFILE_BLOCK_ID: the block of a deeper
+//recursive invocation and the blocks of a site registered after the thread
+//cannot be created when the thread is registered, and creating a block for
+//every site would report the sites that the thread never calls
+
+extern const char *__start_gwp_sites[] __attribute__((weak));
+extern const char *__stop_gwp_sites[] __attribute__((weak));
+
+extern __thread profile_static_t *profile_static_site;
+
+#define PROFILE_NSITE ((int) (__stop_gwp_sites - __start_gwp_sites))
+
+#endif
 
 int return_pid(int);
-void init_block(int [RECURSE_MAX]);
-int new_block(int, const char *, int *);
+void new_site(int *);
+profile_static_t *new_static_chunk(int);
+void new_block(int, const char *, profile_static_t *);
+void new_site_block(int, int, profile_static_t *);
+int register_site(const char *);
 void begin_block(int, int);
 void end_block(int);
+void skip_block(int, int);
+void end_skip(void);
+int next_sample(int);
 void init_profile(void);
 void clear_profile(void);
 void dump_profile(int, int);
+void dump_profile_all(int);
+void snapshot_profile(int, int);
 
-#define GET_COUNTER(P) clock_gettime(CLOCK_THREAD_CPUTIME_ID, P)
+//return the state of site in the calling thread
+
+static inline __attribute__((no_instrument_function))
+profile_static_t *return_static(int site)
+{
+  int ichunk = PROFILE_CHUNK(site, PROFILE_STATIC_CHUNK);
+
+  profile_static_t *chunk = profile_static_chunk[ichunk];
+
+  if (chunk == NULL) chunk = new_static_chunk(ichunk);
+
+  return(chunk + PROFILE_OFFSET(site, PROFILE_STATIC_CHUNK, ichunk));
+}
+
+//the state of the site of a BEGIN_BLOCK in the calling thread
+
+#if defined(PROFILE_REGISTER) && defined(__cplusplus)
+
+#define PROFILE_SITE(X) \
+    struct profile_tag {static const char *name(void) {return(X);}};\
+    profile_static_t *profile_static =\
+      profile_static_site + profile_site_t<profile_tag>::site_id;
+
+#define PROFILE_NEW_BLOCK(X) \
+    new_site_block(pid, profile_site_t<profile_tag>::site_id, profile_static);
+
+#elif defined(PROFILE_REGISTER)
+
+#define PROFILE_SITE(X) \
+    static const char *profile_site_name\
+      __attribute__((section("gwp_sites"), used)) = X;\
+    profile_static_t *profile_static =\
+      profile_static_site + (&profile_site_name - __start_gwp_sites);
+
+#define PROFILE_NEW_BLOCK(X) \
+    new_site_block(pid, (int) (&profile_site_name - __start_gwp_sites),\
+      profile_static);
+
+#else
+
+#define PROFILE_SITE(X) \
+    static int profile_site = PROFILE_INVALID;\
+    if (__atomic_load_n(&profile_site, __ATOMIC_ACQUIRE) == PROFILE_INVALID)\
+      new_site(&profile_site);\
+    profile_static_t *profile_static = return_static(profile_site);
+
+#define PROFILE_NEW_BLOCK(X) new_block(pid, X, profile_static);
+
+#endif
+
+#ifdef PROFILE_SAMPLE
+
+//sampling, compile with -DPROFILE_SAMPLE=<N>
+//on average only one in N calls of a block is timed, the other calls and
+//all the calls they make are only counted, so they do not read the counter
+//BEGIN_BLOCK_SAMPLE sets N for a single block
+
+//with -DPROFILE_FLAT_RECURSION the recursive calls of a sampled call are
+//sampled too, since all the invocations share the means of the block
+
+#ifdef PROFILE_FLAT_RECURSION
+#define PROFILE_SKIP \
+  ((PG.unsampled > 0) || ((PS.block_invocation == 1) && (--PS.block_sample > 0)))
+#else
+#define PROFILE_SKIP ((PG.unsampled > 0) || (--PS.block_sample > 0))
+#endif
+
+#define BEGIN_BLOCK_SAMPLE(X, N) \
+  {\
+    int pid = PID;\
+    PROFILE_SITE(X)\
+    PS.block_invocation++;\
+    if (PROFILE_BLOCK_ID == PROFILE_INVALID)\
+      PROFILE_NEW_BLOCK(X)\
+    if (PROFILE_SKIP)\
+      skip_block(pid, PROFILE_BLOCK_ID);\
+    else\
+    {\
+      counter_t counter_stamp;\
+      PS.block_sample = next_sample(N);\
+      GET_COUNTER(&counter_stamp);\
+      PG.counter_stamp = counter_stamp;\
+      begin_block(pid, PROFILE_BLOCK_ID);\
+      GET_COUNTER(PG.counter_pointer);\
+    }\
+  }
+
+#define BEGIN_BLOCK(X) BEGIN_BLOCK_SAMPLE(X, PROFILE_SAMPLE)
+
+#define END_BLOCK \
+  {\
+    if (PG.unsampled > 0)\
+      end_skip();\
+    else\
+    {\
+      counter_t counter_stamp;\
+      GET_COUNTER(&counter_stamp);\
+      int pid = PID;\
+      PG.counter_stamp = counter_stamp;\
+      end_block(pid);\
+      GET_COUNTER(PG.counter_pointer);\
+    }\
+  }
+
+#else
 
 #define BEGIN_BLOCK(X) \
   {\
-    static profile_static_t profile_static[THREAD_MAX];\
     counter_t counter_stamp;\
     GET_COUNTER(&counter_stamp);\
     int pid = PID;\
     PG.counter_stamp = counter_stamp;\
-    if (PS.block_init == 0) {init_block(PS.block_id); PS.block_init = 1;}\
+    PROFILE_SITE(X)\
     PS.block_invocation++;\
-    if (PS.block_id[PS.block_invocation] == PROFILE_INVALID)\
-      PS.block_id[PS.block_invocation] = new_block(pid, X, &(PS.block_invocation));\
-    begin_block(pid, PS.block_id[PS.block_invocation]);\
+    if (PROFILE_BLOCK_ID == PROFILE_INVALID)\
+      PROFILE_NEW_BLOCK(X)\
+    begin_block(pid, PROFILE_BLOCK_ID);\
     GET_COUNTER(PG.counter_pointer);\
   }
 #define END_BLOCK \
@@ -69,14 +336,74 @@ void dump_profile(int, int);
     GET_COUNTER(PG.counter_pointer);\
   }
 
+#define BEGIN_BLOCK_SAMPLE(X, N) BEGIN_BLOCK(X)
+
+#endif
+
 #define INIT_PROFILE init_profile();
+#define PROFILE_THREAD_BEGIN (void) PID;
 #define DUMP_PROFILE(V) dump_profile(PID, V);
+#define DUMP_PROFILE_ALL(V) dump_profile_all(V);
+#define SNAPSHOT_PROFILE(V, R) snapshot_profile(V, R);
+#define CLEAR_PROFILE clear_profile();
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __cplusplus
+
+//scoped block for C++, the destructor ends the block, so the stack stays
+//consistent on early returns and when an exception unwinds the scope
+//the body of the destructor is END_BLOCK
+
+struct profile_scope_t
+{
+  profile_scope_t(void) {}
+
+  profile_scope_t(const profile_scope_t &) = delete;
+  profile_scope_t &operator=(const profile_scope_t &) = delete;
+
+  inline __attribute__((always_inline)) ~profile_scope_t(void) END_BLOCK
+};
+
+#define PROFILE_CONCAT2(A, B) A ## B
+#define PROFILE_CONCAT(A, B) PROFILE_CONCAT2(A, B)
+
+#define PROFILE_SCOPE(X) \
+  BEGIN_BLOCK(X)\
+  profile_scope_t PROFILE_CONCAT(profile_scope_, __LINE__);
+
+#define PROFILE_SCOPE_SAMPLE(X, N) \
+  BEGIN_BLOCK_SAMPLE(X, N)\
+  profile_scope_t PROFILE_CONCAT(profile_scope_, __LINE__);
+
+#endif
+
+#if defined(PROFILE_REGISTER) && defined(__cplusplus)
+
+template<typename T> struct profile_site_t
+{
+  static const int site_id;
+};
+
+template<typename T> const int profile_site_t<T>::site_id =
+  register_site(T::name());
+
+#endif
 
 #else
 #define BEGIN_BLOCK(X)
+#define BEGIN_BLOCK_SAMPLE(X, N)
+#define PROFILE_SCOPE(X)
+#define PROFILE_SCOPE_SAMPLE(X, N)
 #define END_BLOCK
 #define INIT_PROFILE
+#define PROFILE_THREAD_BEGIN
 #define DUMP_PROFILE(V)
+#define DUMP_PROFILE_ALL(V)
+#define SNAPSHOT_PROFILE(V, R)
+#define CLEAR_PROFILE
 #endif
 
 #endif
@@ -0,0 +1,249 @@
+#ifndef ProfileDataH
+#define ProfileDataH
+
+//the profile data of GWP, the blocks, their call graph and histograms,
+//for programs that read their profiles with query_profile, this header can
+//be included from C and C++
+
+#include "profile.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROFILE_NAME_MAX 32
+#define PROFILE_HOST_MAX 64
+
+//entries in the first chunk of the block table
+
+#define BLOCK_CHUNK 64
+
+#define CHUNK_ENTRY(C, I, M) \
+  ((C)[PROFILE_CHUNK(I, M)] + PROFILE_OFFSET(I, M, PROFILE_CHUNK(I, M)))
+
+#define BLOCK(W, I) CHUNK_ENTRY((W)->block_chunk, I, BLOCK_CHUNK)
+
+//call graph edge to the parent or child of a block
+
+typedef struct
+{
+  int edge_id;
+  long long edge_calls;
+  double edge_time_total;
+  double edge_time_off_total;
+} edge_t;
+
+//open-addressed hash table with linear probing keyed by the block id
+//of the parent or child, nedge_max is zero or a power of two
+
+typedef struct
+{
+  int nedge;
+  int nedge_max;
+  edge_t *edge;
+} edges_t;
+
+//histogram of the ticks per call
+//the buckets are logarithmic with HISTOGRAM_SUB sub-buckets per power of two,
+//so the width of a bucket is at most 1/HISTOGRAM_SUB of its ticks
+//ticks of 2^HISTOGRAM_LOG2_MAX and more are counted in the last bucket
+
+#define HISTOGRAM_BITS     3
+#define HISTOGRAM_SUB      (1 << HISTOGRAM_BITS)
+#define HISTOGRAM_LOG2_MAX 40
+
+#define NHISTOGRAM ((HISTOGRAM_LOG2_MAX - HISTOGRAM_BITS + 1) * HISTOGRAM_SUB)
+
+typedef struct
+{
+  long long histogram_ticks_max;
+  long long histogram_count[NHISTOGRAM];
+} histogram_t;
+
+//hardware performance counters, collected with -DPROFILE_PERF
+
+#define PERF_INSTRUCTIONS  0
+#define PERF_CYCLES        1
+#define PERF_LLC_MISSES    2
+#define PERF_L1D_MISSES    3
+#define PERF_BRANCH_MISSES 4
+
+#define NPERF 5
+
+//the calls per power of two of the recursion depth of -DPROFILE_FLAT_RECURSION,
+//depth 1, 2-3, 4-7.., the last bucket counts the deeper calls too
+
+#define NDEPTH 8
+
+typedef struct
+{
+  //the full name, the string literal of the site or an interned name,
+  //it is only shortened to PROFILE_NAME_MAX - 1 characters in the tables
+
+  const char *block_name;
+  int block_invocation;
+
+  //needed for end_block
+  int *block_invocation_pointer;
+
+  //the function of a block of -DPROFILE_FUNCTIONS until its name is resolved
+
+  void *block_address;
+
+  long long block_calls;
+
+  double block_time_self_total;
+  double block_time_total;
+
+  long long block_child_calls;
+  double block_child_time_total;
+
+  edges_t block_parents;
+  edges_t block_children;
+
+  histogram_t *block_self_histogram;
+  histogram_t *block_total_histogram;
+
+  long long block_perf_self[NPERF];
+  long long block_perf_total[NPERF];
+
+  //the wall-clock time minus the CPU time, collected with -DPROFILE_WALL
+
+  double block_time_off_self;
+  double block_time_off_total;
+
+  //the calls of malloc, calloc, realloc and free, collected with
+  //-DPROFILE_MALLOC
+
+  long long block_mallocs_self;
+  long long block_malloc_bytes_self;
+  long long block_frees_self;
+  long long block_mallocs_total;
+  long long block_malloc_bytes_total;
+
+  long long block_depth_calls[NDEPTH];
+
+  //the calls that were only counted by -DPROFILE_DEINSTRUMENT
+
+  long long block_calls_deinstrumented;
+
+  //the outermost calls that were only counted, for -DPROFILE_FLAT_RECURSION
+
+  long long block_calls_outermost_deinstrumented;
+
+  //TRUE if the site of the block is de-instrumented, block_sample_pointer
+  //is the sample count down of the site, only used by the thread itself
+
+  int block_deinstrumented;
+  int *block_sample_pointer;
+
+  //the sampled calls, only used by the thread that samples the calls
+
+  long long block_calls_sampled;
+  double block_time_self_sampled;
+  double block_time_total_sampled;
+
+  //the sampled outermost calls of -DPROFILE_FLAT_RECURSION
+
+  long long block_calls_outermost_sampled;
+  double block_time_outermost_sampled;
+
+  double block_time_recursive_total;
+  long long block_calls_recursive_total;
+
+  //only used when the profiles of threads are merged
+
+  int block_nthread;
+
+  double block_time_self_min;
+  double block_time_self_max;
+
+  double block_time_total_min;
+  double block_time_total_max;
+} block_t;
+
+//the profile of a thread, or of merged threads if nmerged > 0
+
+typedef struct
+{
+  char profile_counter[PROFILE_NAME_MAX];
+  long long profile_frequency;
+  long long profile_counter_mean;
+  long long profile_counter_sigma;
+  long long profile_ncall;
+  long long profile_ncounter_largest;
+  long long profile_counter_largest;
+  int profile_fixed_correction;
+  double profile_counter_correction;
+  long long profile_stamp;
+
+  //the process that wrote the profile, profile_rank is PROFILE_INVALID if
+  //the process has no rank
+
+  char profile_host[PROFILE_HOST_MAX];
+  int profile_process;
+  int profile_rank;
+
+  //bit PERF_<event> is set if the hardware counter of the event was counted
+
+  int profile_perf;
+
+  //TRUE if the off-CPU times were collected
+
+  int profile_wall;
+
+  //TRUE if the allocations were counted
+
+  int profile_malloc;
+
+  //TRUE if the recursive invocations of a site share a block
+
+  int profile_flat_recursion;
+
+  //N of -DPROFILE_SAMPLE=<N>, zero without sampling
+
+  int profile_sample;
+
+  //M of -DPROFILE_DEINSTRUMENT=<M>, zero without de-instrumentation
+
+  int profile_deinstrument;
+
+  int nmerged;
+
+  double time_total;
+
+  //the blocks that are not terminated by an END_BLOCK
+
+  int nstack;
+  int *stack;
+
+  int nblock;
+  block_t *block_chunk[PROFILE_CHUNK_MAX];
+
+  //hash table of block ids keyed by name and invocation used when merging
+
+  int nhash;
+  int *hash;
+
+  //edge tables that were replaced by larger tables, they are kept until
+  //free_profile if other threads can read the profile while it is updated
+
+  int retain_edges;
+  int nretired;
+  int nretired_max;
+  edge_t **retired;
+} profile_t;
+
+//the query API of profile.c, a program that is profiled can read the profiles
+//of its threads while they keep running
+
+void query_profile(profile_t *, int);
+int find_block(profile_t *, const char *, int);
+long long return_percentile(histogram_t *, double);
+void free_profile(profile_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,2297 @@
+#include "profile_report.h"
+
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define PERC(X)   ((X) / time_self_total * 100)
+
+//the maximum over threads relative to the mean over threads
+
+#define IMBALANCE(MAX, TOTAL, N) ((TOTAL) > 0.0 ? (MAX) / ((TOTAL) / (N)) : 1.0)
+
+//chunks are zeroed and aligned to cache lines, so the chunks of different
+//threads never share a cache line
+
+void *new_chunk(int ichunk, int nchunk, size_t size)
+{
+  size_t nbytes = ((size_t) nchunk << ichunk) * size;
+
+  nbytes = (nbytes + PROFILE_CACHE_LINE - 1) & ~((size_t) PROFILE_CACHE_LINE - 1);
+
+  void *result;
+
+  PROFILE_BUG((result = aligned_alloc(PROFILE_CACHE_LINE, nbytes)) == NULL)
+
+  memset(result, 0, nbytes);
+
+  return(result);
+}
+
+void clear_edges(edges_t *with_edges)
+{
+  with_edges->nedge = 0;
+
+  for (int iedge = 0; iedge < with_edges->nedge_max; iedge++)
+    with_edges->edge[iedge].edge_id = PROFILE_INVALID;
+}
+
+#define NEDGE_MIN 8
+
+//the new table is filled before it replaces the old table, the table is
+//published before its size, so a thread that reads the edges of a live
+//profile never reads beyond the end of a table
+//the old table is kept if with retains its edge tables
+
+void grow_edges(profile_t *with, edges_t *with_edges)
+{
+  int nedge_max = with_edges->nedge_max;
+  edge_t *edge = with_edges->edge;
+
+  int nedge_max_new = (nedge_max == 0) ? NEDGE_MIN : 2 * nedge_max;
+
+  edge_t *edge_new = new_chunk(0, nedge_max_new, sizeof(edge_t));
+
+  for (int iedge = 0; iedge < nedge_max_new; iedge++)
+    edge_new[iedge].edge_id = PROFILE_INVALID;
+
+  unsigned int mask = nedge_max_new - 1;
+
+  for (int iedge = 0; iedge < nedge_max; iedge++)
+  {
+    if (edge[iedge].edge_id == PROFILE_INVALID) continue;
+
+    unsigned int jedge = HASH_EDGE(edge[iedge].edge_id) & mask;
+
+    while(edge_new[jedge].edge_id != PROFILE_INVALID)
+      jedge = (jedge + 1) & mask;
+
+    edge_new[jedge] = edge[iedge];
+  }
+
+  __atomic_store_n(&(with_edges->edge), edge_new, __ATOMIC_RELEASE);
+  __atomic_store_n(&(with_edges->nedge_max), nedge_max_new, __ATOMIC_RELEASE);
+
+  if (edge == NULL) return;
+
+  if (!with->retain_edges)
+  {
+    free(edge);
+
+    return;
+  }
+
+  if (with->nretired == with->nretired_max)
+  {
+    with->nretired_max = (with->nretired_max == 0) ? NEDGE_MIN : 2 * with->nretired_max;
+
+    PROFILE_BUG((with->retired = realloc(with->retired,
+      with->nretired_max * sizeof(edge_t *))) == NULL)
+  }
+
+  with->retired[with->nretired++] = edge;
+}
+
+local int compare_edges(const void *a, const void *b)
+{
+  const edge_t *edge_a = a;
+  const edge_t *edge_b = b;
+
+  return((edge_a->edge_id > edge_b->edge_id) -
+         (edge_a->edge_id < edge_b->edge_id));
+}
+
+//copy the edges to sorted in order of block id, returns the number of edges
+
+local int sort_edges(edges_t *with_edges, edge_t *sorted)
+{
+  int nsorted = 0;
+
+  for (int iedge = 0; iedge < with_edges->nedge_max; iedge++)
+    if (with_edges->edge[iedge].edge_id != PROFILE_INVALID)
+      sorted[nsorted++] = with_edges->edge[iedge];
+
+  qsort(sorted, nsorted, sizeof(edge_t), compare_edges);
+
+  return(nsorted);
+}
+
+void clear_histogram(histogram_t *with_histogram)
+{
+  memset(with_histogram, 0, sizeof(histogram_t));
+}
+
+void merge_histogram(histogram_t *with_merged, histogram_t *with_histogram)
+{
+  for (int ibucket = 0; ibucket < NHISTOGRAM; ibucket++)
+    with_merged->histogram_count[ibucket] +=
+      with_histogram->histogram_count[ibucket];
+
+  if (with_histogram->histogram_ticks_max > with_merged->histogram_ticks_max)
+    with_merged->histogram_ticks_max = with_histogram->histogram_ticks_max;
+}
+
+//the largest ticks of bucket
+
+local long long return_bucket_max(int ibucket)
+{
+  if (ibucket < HISTOGRAM_SUB) return(ibucket);
+
+  int shift = (ibucket >> HISTOGRAM_BITS) - 1;
+
+  long long result = (long long) (HISTOGRAM_SUB + (ibucket & (HISTOGRAM_SUB - 1)))
+                     << shift;
+
+  return(result + (1LL << shift) - 1);
+}
+
+//the number of calls in the histogram, and the mean and variance of the
+//ticks per call estimated from the midpoints of the buckets
+
+local long long return_moments(histogram_t *with_histogram,
+  double *mean, double *variance)
+{
+  long long ncall = 0;
+
+  double sum = 0.0;
+  double sum2 = 0.0;
+
+  for (int ibucket = 0; ibucket < NHISTOGRAM; ibucket++)
+  {
+    long long n = with_histogram->histogram_count[ibucket];
+
+    if (n == 0) continue;
+
+    long long bucket_min = (ibucket == 0) ? 0 : return_bucket_max(ibucket - 1) + 1;
+
+    double x = (bucket_min + return_bucket_max(ibucket)) / 2.0;
+
+    ncall += n;
+
+    sum += n * x;
+
+    sum2 += n * x * x;
+  }
+
+  *mean = 0.0;
+  *variance = 0.0;
+
+  if (ncall == 0) return(0);
+
+  *mean = sum / ncall;
+
+  if (ncall > 1) *variance = (sum2 - sum * sum / ncall) / (ncall - 1);
+
+  if (*variance < 0.0) *variance = 0.0;
+
+  return(ncall);
+}
+
+//the ticks below which a fraction of the calls falls, the upper bound of
+//the bucket but never more than the largest ticks
+
+long long return_percentile(histogram_t *with_histogram, double fraction)
+{
+  long long ncall = 0;
+
+  for (int ibucket = 0; ibucket < NHISTOGRAM; ibucket++)
+    ncall += with_histogram->histogram_count[ibucket];
+
+  if (ncall == 0) return(0);
+
+  long long rank = (long long) ceil(fraction * ncall);
+
+  if (rank < 1) rank = 1;
+
+  long long n = 0;
+
+  for (int ibucket = 0; ibucket < NHISTOGRAM; ibucket++)
+  {
+    n += with_histogram->histogram_count[ibucket];
+
+    if (n >= rank)
+    {
+      long long result = return_bucket_max(ibucket);
+
+      if (result > with_histogram->histogram_ticks_max)
+        result = with_histogram->histogram_ticks_max;
+
+      return(result);
+    }
+  }
+
+  return(with_histogram->histogram_ticks_max);
+}
+
+#define MANGLE_MAX 256
+
+local void mangle(char *dest, const char *source)
+{
+  char m[MANGLE_MAX];
+
+  if (strlen(source) < NAME_MAX)
+    strncpy(dest, source, NAME_MAX);
+  else
+  {
+    PROFILE_BUG(strlen(source) >= MANGLE_MAX)
+
+    strncpy(m, source, MANGLE_MAX);
+    
+    //remove vowels from the right
+
+    int n = strlen(m);
+
+    while(n >= NAME_MAX)
+    {
+      //search for a vowel or underscore from the right
+
+      while(n >= 0)
+      {
+        //first vowels
+
+        if ((m[n] == 'a') || (m[n] == 'o') or (m[n] == 'u') or
+            (m[n] == 'i') or (m[n] == 'e')) break;
+        
+        //then underscores
+
+        if (m[n] == '_') break;
+
+        n--;
+      }
+      PROFILE_BUG(n < 0)
+      
+      //remove vowel
+
+      while((m[n] = m[n + 1]) != '\0') n++;
+    }
+    PROFILE_BUG(strlen(m) >= NAME_MAX)
+
+    strncpy(dest, m, NAME_MAX - 1);
+  }
+}
+
+//shorten a name to NAME_MAX - 1 characters for the tables, by removing
+//vowels and underscores from the right or else by truncating it
+
+const char *format_name(char *dest, const char *source)
+{
+  if (strlen(source) >= NAME_MAX)
+  {
+    //mangle can only shorten names with enough vowels and underscores
+
+    int nremove = 0;
+
+    for (const char *c = source; *c != '\0'; c++)
+      if (strchr("aeiou_", *c) != NULL) nremove++;
+
+    if ((strlen(source) < MANGLE_MAX) &&
+        ((int) strlen(source) - nremove < NAME_MAX))
+    {
+      mangle(dest, source);
+
+      dest[NAME_MAX - 1] = '\0';
+
+      return(dest);
+    }
+  }
+
+  snprintf(dest, NAME_MAX, "%s", source);
+
+  return(dest);
+}
+
+//the names that are not string literals, read from a binary profile or
+//resolved from an address, are interned in a hash table that is never
+//freed, so merged profiles can share the names
+//the table is only updated at dump time, a spin lock is enough
+
+local int intern_lock = 0;
+
+local int ninterned = 0;
+local int ninterned_max = 0;
+local const char **interned = NULL;
+
+local unsigned int hash_string(const char *name)
+{
+  unsigned int result = 2166136261U;
+
+  for (const char *c = name; *c != '\0'; c++)
+    result = (result ^ (unsigned char) *c) * 16777619U;
+
+  return(result);
+}
+
+const char *intern_name(const char *name)
+{
+  while(__atomic_test_and_set(&intern_lock, __ATOMIC_ACQUIRE));
+
+  if (2 * (ninterned + 1) > ninterned_max)
+  {
+    int nmax = ninterned_max == 0 ? 256 : 2 * ninterned_max;
+
+    const char **table;
+
+    PROFILE_BUG((table = calloc(nmax, sizeof(const char *))) == NULL)
+
+    for (int iinterned = 0; iinterned < ninterned_max; iinterned++)
+    {
+      if (interned[iinterned] == NULL) continue;
+
+      unsigned int ihash = hash_string(interned[iinterned]) & (nmax - 1);
+
+      while(table[ihash] != NULL) ihash = (ihash + 1) & (nmax - 1);
+
+      table[ihash] = interned[iinterned];
+    }
+
+    free(interned);
+
+    interned = table;
+
+    ninterned_max = nmax;
+  }
+
+  unsigned int mask = ninterned_max - 1;
+  unsigned int ihash = hash_string(name) & mask;
+
+  while((interned[ihash] != NULL) && (strcmp(interned[ihash], name) != 0))
+    ihash = (ihash + 1) & mask;
+
+  if (interned[ihash] == NULL)
+  {
+    PROFILE_BUG((interned[ihash] = strdup(name)) == NULL)
+
+    ninterned++;
+  }
+
+  const char *result = interned[ihash];
+
+  __atomic_clear(&intern_lock, __ATOMIC_RELEASE);
+
+  return(result);
+}
+
+void clear_block(block_t *with_block)
+{
+  with_block->block_calls = 0;
+
+  with_block->block_time_self_total = 0.0;
+  with_block->block_time_total = 0.0;
+
+  clear_edges(&(with_block->block_parents));
+  clear_edges(&(with_block->block_children));
+
+  clear_histogram(with_block->block_self_histogram);
+  clear_histogram(with_block->block_total_histogram);
+
+  for (int iperf = 0; iperf < NPERF; iperf++)
+  {
+    with_block->block_perf_self[iperf] = 0;
+    with_block->block_perf_total[iperf] = 0;
+  }
+
+  with_block->block_time_off_self = 0.0;
+  with_block->block_time_off_total = 0.0;
+
+  with_block->block_mallocs_self = 0;
+  with_block->block_malloc_bytes_self = 0;
+  with_block->block_frees_self = 0;
+  with_block->block_mallocs_total = 0;
+  with_block->block_malloc_bytes_total = 0;
+
+  for (int idepth = 0; idepth < NDEPTH; idepth++)
+    with_block->block_depth_calls[idepth] = 0;
+
+  with_block->block_calls_sampled = 0;
+  with_block->block_time_self_sampled = 0.0;
+  with_block->block_time_total_sampled = 0.0;
+
+  with_block->block_calls_outermost_sampled = 0;
+  with_block->block_time_outermost_sampled = 0.0;
+
+  with_block->block_calls_deinstrumented = 0;
+  with_block->block_calls_outermost_deinstrumented = 0;
+  with_block->block_deinstrumented = FALSE;
+}
+
+//append a cleared block to the block table of with
+
+int add_block(profile_t *with)
+{
+  int block_id = with->nblock;
+
+  int ichunk = PROFILE_CHUNK(block_id, BLOCK_CHUNK);
+
+  if (with->block_chunk[ichunk] == NULL)
+    with->block_chunk[ichunk] = new_chunk(ichunk, BLOCK_CHUNK, sizeof(block_t));
+
+  block_t *with_block = BLOCK(with, block_id);
+
+  if (with_block->block_self_histogram == NULL)
+  {
+    with_block->block_self_histogram = new_chunk(0, 1, sizeof(histogram_t));
+    with_block->block_total_histogram = new_chunk(0, 1, sizeof(histogram_t));
+  }
+
+  clear_block(with_block);
+
+  //the block is cleared before it becomes visible to other threads
+
+  __atomic_store_n(&(with->nblock), block_id + 1, __ATOMIC_RELEASE);
+
+  return(block_id);
+}
+
+#define HASH_NAME_SEED  2166136261U
+#define HASH_NAME_PRIME 16777619U
+
+local unsigned int hash_name(const char *name, int invocation)
+{
+  unsigned int result = HASH_NAME_SEED;
+
+  for (const char *c = name; *c != '\0'; c++)
+    result = (result ^ (unsigned char) *c) * HASH_NAME_PRIME;
+
+  return((result ^ (unsigned int) invocation) * HASH_NAME_PRIME);
+}
+
+//the sort key of the recursive table
+
+#define SORT_RECURSIVE 4
+#define SORT_OFF       5
+#define SORT_MALLOC    6
+
+local const char *sort_names[] = {"default", "calls", "self time", "total time"};
+
+//key_default is the key of the table, used if key is SORT_DEFAULT
+
+local double sort_value(block_t *with_block, int key, int key_default)
+{
+  int recursive = (key_default == SORT_RECURSIVE);
+
+  if (key == SORT_DEFAULT) key = key_default;
+
+  if (key == SORT_CALLS)
+    return(recursive ? with_block->block_calls_recursive_total :
+                       with_block->block_calls);
+
+  if (key == SORT_SELF)
+    return(recursive ? with_block->block_time_recursive_total :
+                       with_block->block_time_self_total);
+
+  if (key == SORT_TOTAL) return(with_block->block_time_total);
+
+  if (key_default == SORT_OFF) return(with_block->block_time_off_self);
+
+  if (key_default == SORT_MALLOC) return(with_block->block_malloc_bytes_self);
+
+  return(with_block->block_time_recursive_total);
+}
+
+typedef struct
+{
+  double sorted_value;
+  int sorted_id;
+} sorted_t;
+
+//descending on the sort value, ascending on the block id for equal values
+
+local int compare_sorted(const void *a, const void *b)
+{
+  const sorted_t *sorted_a = a;
+  const sorted_t *sorted_b = b;
+
+  if (sorted_a->sorted_value > sorted_b->sorted_value) return(-1);
+  if (sorted_a->sorted_value < sorted_b->sorted_value) return(1);
+
+  return(sorted_a->sorted_id - sorted_b->sorted_id);
+}
+
+//sort the blocks in sort in descending order of the sort value
+//sorted has room for nblock entries
+
+local void sort_blocks(profile_t *with, int *sort, sorted_t *sorted,
+  int key, int key_default)
+{
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    sorted[iblock].sorted_value =
+      sort_value(BLOCK(with, iblock), key, key_default);
+    sorted[iblock].sorted_id = iblock;
+  }
+
+  qsort(sorted, with->nblock, sizeof(sorted_t), compare_sorted);
+
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+    sort[iblock] = sorted[iblock].sorted_id;
+}
+
+//sum the self times and calls of the recursive invocations of a block in
+//its first invocation, the blocks are grouped by name in a hash table
+
+local void sum_recursive(profile_t *with)
+{
+  int nhash = 2;
+
+  while(nhash < 2 * with->nblock) nhash *= 2;
+
+  unsigned int mask = nhash - 1;
+
+  int *hash;
+
+  PROFILE_BUG((hash = malloc(nhash * sizeof(int))) == NULL)
+
+  for (int ihash = 0; ihash < nhash; ihash++)
+    hash[ihash] = PROFILE_INVALID;
+
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    block_t *with_block = BLOCK(with, iblock);
+
+    with_block->block_time_recursive_total = 0.0;
+
+    with_block->block_calls_recursive_total = 0;
+
+    if (with_block->block_invocation != 1) continue;
+
+    with_block->block_time_recursive_total = with_block->block_time_self_total;
+
+    with_block->block_calls_recursive_total = with_block->block_calls;
+
+    unsigned int ihash = hash_name(with_block->block_name, 1) & mask;
+
+    while(hash[ihash] != PROFILE_INVALID) ihash = (ihash + 1) & mask;
+
+    hash[ihash] = iblock;
+  }
+
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    block_t *with_block = BLOCK(with, iblock);
+
+    if (with_block->block_invocation == 1) continue;
+
+    unsigned int ihash = hash_name(with_block->block_name, 1) & mask;
+
+    while(hash[ihash] != PROFILE_INVALID)
+    {
+      block_t *with_first = BLOCK(with, hash[ihash]);
+
+      if (strcmp(with_first->block_name, with_block->block_name) == 0)
+      {
+        with_first->block_time_recursive_total +=
+          with_block->block_time_self_total;
+
+        with_first->block_calls_recursive_total += with_block->block_calls;
+
+        break;
+      }
+
+      ihash = (ihash + 1) & mask;
+    }
+  }
+
+  free(hash);
+}
+
+//the tables are sorted on their own key unless sort_key is not SORT_DEFAULT
+
+#define PERF_COUNTED(W, I) (((W)->profile_perf & (1 << (I))) != 0)
+
+local void print_ipc(FILE *f, profile_t *with, long long *perf)
+{
+  if (PERF_COUNTED(with, PERF_INSTRUCTIONS) && PERF_COUNTED(with, PERF_CYCLES) &&
+      (perf[PERF_CYCLES] > 0))
+    fprintf(f, " %10.2f", (double) perf[PERF_INSTRUCTIONS] / perf[PERF_CYCLES]);
+  else
+    fprintf(f, " %10s", "-");
+}
+
+local void print_per_call(FILE *f, profile_t *with, long long *perf, int iperf,
+  long long calls)
+{
+  if (PERF_COUNTED(with, iperf) && (calls > 0))
+    fprintf(f, " %10.2f", (double) perf[iperf] / calls);
+  else
+    fprintf(f, " %10s", "-");
+}
+
+void report_profile(FILE *f, profile_t *with, int sort_key, int verbose)
+{
+  //the names of the blocks are shortened for the tables
+
+  char name[NAME_MAX];
+
+  int nmerged = with->nmerged;
+
+  {
+    char stamp[NAME_MAX];
+    time_t t = with->profile_stamp;
+    struct tm tm;
+
+    //threads can dump their profiles concurrently
+
+    if (localtime_r(&t, &tm) == NULL)
+      snprintf(stamp, NAME_MAX, "?");
+    else
+      (void) strftime(stamp, NAME_MAX, "%H:%M:%S-%d/%m/%Y", &tm);
+
+    fprintf(f, "# Profile dumped at %s\n", stamp);
+  }
+
+  if (with->profile_host[0] != '\0')
+  {
+    if (with->profile_process == PROFILE_INVALID)
+      fprintf(f, "# The profiles were written by several processes on %s.\n",
+        with->profile_host);
+    else if (with->profile_rank != PROFILE_INVALID)
+      fprintf(f, "# The profile was written by process %d, rank %d, on %s.\n",
+        with->profile_process, with->profile_rank, with->profile_host);
+    else
+      fprintf(f, "# The profile was written by process %d on %s.\n",
+        with->profile_process, with->profile_host);
+  }
+
+  fprintf(f, "# The counter is %s.\n", with->profile_counter);
+  fprintf(f, "# The frequency is %llu ticks, or %.10f secs/tick.\n",
+    with->profile_frequency, 1.0/with->profile_frequency);
+  fprintf(f, "# The intrinsic profile overhead is %lld ticks on average.\n",
+    with->profile_counter_mean);
+  if (with->profile_fixed_correction)
+    fprintf(f, "# The intrinsic profile overhead is corrected with %lld ticks.\n",
+      llround(with->profile_counter_correction));
+  fprintf(f, "# %lld out of %lld samples of the intrinsic profile overhead\n"
+             "# ..are larger than the mean plus 3 sigma, the largest value is %lld.\n",
+             with->profile_ncounter_largest, with->profile_ncall,
+             with->profile_counter_largest);
+
+  if (nmerged > 0)
+    fprintf(f, "# The profile merges %d threads.\n", nmerged);
+
+  fprintf(f, "# The total number of blocks is %d.\n", with->nblock);
+
+  if (with->nstack > 0)
+  {
+    fprintf(f, "# The following blocks are not properly terminated by an END_BLOCK!\n");
+
+    for (int istack = 0; istack < with->nstack; istack++)
+    {
+      block_t *with_block = BLOCK(with, with->stack[istack]);
+
+      fprintf(f, "%s (invocation %d)\n",
+        with_block->block_name,with_block->block_invocation);
+    }
+    fprintf(f, "\n");
+  }
+
+  //total time
+
+  double time_self_total = 0.0;
+
+  block_t *with_main = NULL;
+  block_t *with_main_thread = NULL;
+
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    block_t *with_block = BLOCK(with, iblock);
+
+    if (strcmp(with_block->block_name, "main") == 0)
+      with_main = with_block;
+    if (strcmp(with_block->block_name, "main-thread") == 0)
+      with_main_thread = with_block;
+
+    with_block->block_child_calls = 0;
+
+    with_block->block_child_time_total = 0.0;
+
+    edges_t *with_children = &(with_block->block_children);
+
+    for (int iedge = 0; iedge < with_children->nedge_max; iedge++)
+    {
+      edge_t *with_child = with_children->edge + iedge;
+
+      if (with_child->edge_id == PROFILE_INVALID) continue;
+
+      with_block->block_child_calls += with_child->edge_calls;
+
+      with_block->block_child_time_total += with_child->edge_time_total;
+    }
+
+    time_self_total += with_block->block_time_self_total;
+  }
+
+  //main-thread takes precedence
+
+  if (with_main_thread != NULL) with_main = with_main_thread;
+
+  if (with_main == NULL)
+  {
+    fprintf(stderr, "block main or main-thread not found\n");
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(f, "# The total run time was %.10f secs.\n", with->time_total);
+
+  fprintf(f, "# The total self time was %.10f secs.\n", time_self_total);
+
+  fprintf(f, "# The total profile overhead was %.10f secs.\n",
+    with->time_total - time_self_total);
+
+  //the total time of a block includes the total times of its children,
+  //also with the estimates of the calls that are not sampled, a tick per
+  //call is allowed for rounding
+  //the blocks that are not terminated have not added their times yet
+
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    block_t *with_block = BLOCK(with, iblock);
+
+    int terminated = TRUE;
+
+    for (int istack = 0; istack < with->nstack; istack++)
+      if (with->stack[istack] == iblock) terminated = FALSE;
+
+    if (!terminated) continue;
+
+    if (with_block->block_time_total <
+        with_block->block_child_time_total -
+        (double) with_block->block_child_calls / with->profile_frequency -
+        1.0e-9 * with_block->block_child_time_total)
+      fprintf(f, "# The total time of %s (invocation %d) is less than the "
+                 "total time of its children!\n",
+        with_block->block_name, with_block->block_invocation);
+  }
+
+  if (sort_key != SORT_DEFAULT)
+    fprintf(f, "# The tables are sorted by %s.\n", sort_names[sort_key]);
+
+  fprintf(f, "\n");
+
+  int *sort;
+
+  PROFILE_BUG((sort = malloc(with->nblock * sizeof(int))) == NULL)
+
+  sorted_t *sorted;
+
+  PROFILE_BUG((sorted = malloc(with->nblock * sizeof(sorted_t))) == NULL)
+
+  sort_blocks(with, sort, sorted, sort_key, SORT_TOTAL);
+
+  fprintf(f, "# Blocks sorted by total time spent in block and children.\n");
+
+  fprintf(f, "# The sum of total times (or the sum of the percentages)\n");
+
+  fprintf(f, "# does not have any meaning, since children will be double counted.\n");
+
+  fprintf(f, "%-32s %-10s %6s %16s %10s", 
+    "name", "invocation", "perc", "total time", "calls");
+
+  if (nmerged > 0)
+    fprintf(f, " %7s %16s %16s %9s", "threads", "min", "max", "imbalance");
+
+  fprintf(f, "\n");
+
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    block_t *with_block = BLOCK(with, sort[iblock]);
+
+    fprintf(f, "%-32s %-10d %6.2f %16.10f %10lld",
+      format_name(name, with_block->block_name), with_block->block_invocation,
+      PERC(with_block->block_time_total),
+      with_block->block_time_total,
+      with_block->block_calls);
+
+    if (nmerged > 0)
+      fprintf(f, " %7d %16.10f %16.10f %9.2f",
+        with_block->block_nthread,
+        with_block->block_time_total_min,
+        with_block->block_time_total_max,
+        IMBALANCE(with_block->block_time_total_max, with_block->block_time_total,
+                  with_block->block_nthread));
+
+    fprintf(f, "\n");
+  }
+  fprintf(f, "\n");
+
+  sort_blocks(with, sort, sorted, sort_key, SORT_SELF);
+
+  fprintf(f, "# Blocks sorted by total time spent in own code.\n");
+
+  fprintf(f, "# The sum of the self times is equal to the total self time.\n");
+
+  fprintf(f, "%-32s %-10s %6s %16s %10s", 
+    "name", "invocation", "perc", "self time", "calls");
+
+  if (nmerged > 0)
+    fprintf(f, " %7s %16s %16s %9s", "threads", "min", "max", "imbalance");
+
+  fprintf(f, "\n");
+
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    block_t *with_block = BLOCK(with, sort[iblock]);
+
+    fprintf(f, "%-32s %-10d %6.2f %16.10f %10lld",
+      format_name(name, with_block->block_name), with_block->block_invocation,
+      PERC(with_block->block_time_self_total),
+      with_block->block_time_self_total,
+      with_block->block_calls);
+
+    if (nmerged > 0)
+      fprintf(f, " %7d %16.10f %16.10f %9.2f",
+        with_block->block_nthread,
+        with_block->block_time_self_min,
+        with_block->block_time_self_max,
+        IMBALANCE(with_block->block_time_self_max, with_block->block_time_self_total,
+                  with_block->block_nthread));
+
+    fprintf(f, "\n");
+  }
+  fprintf(f, "\n");
+
+  sum_recursive(with);
+
+  sort_blocks(with, sort, sorted, sort_key, SORT_RECURSIVE);
+
+  fprintf(f, "# Blocks sorted by self times summed over recursive invocations.\n");
+
+  fprintf(f, "%-32s %6s %6s %16s %10s %16s %10s\n",
+    "name", "perc", "%main", "self time", "calls", "self time/call", "ticks/call");
+
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    int jblock = sort[iblock];
+
+    if (BLOCK(with, jblock)->block_invocation == 1)
+    {
+      //blocks can still be in progress in a snapshot
+
+      double self_time_per_call = 0.0;
+      if (BLOCK(with, jblock)->block_calls_recursive_total > 0)
+        self_time_per_call =
+          BLOCK(with, jblock)->block_time_recursive_total / 
+          BLOCK(with, jblock)->block_calls_recursive_total;
+      double main_perc = 0.0;
+      if (with_main->block_time_total > 0.0)
+        main_perc = BLOCK(with, jblock)->block_time_recursive_total /
+                    with_main->block_time_total * 100;
+      long long ticks_per_call = -1;
+      if (self_time_per_call < 1.0)
+        ticks_per_call = round(self_time_per_call * with->profile_frequency);
+
+      fprintf(f, "%-32s %6.2f %6.2f %16.10f %10lld %16.10f %10lld\n",
+        format_name(name, BLOCK(with, jblock)->block_name),
+        PERC(BLOCK(with, jblock)->block_time_recursive_total),
+        main_perc,
+        BLOCK(with, jblock)->block_time_recursive_total,
+        BLOCK(with, jblock)->block_calls_recursive_total,
+        self_time_per_call,
+        ticks_per_call);
+    }
+  }
+  fprintf(f, "\n");
+
+  sort_blocks(with, sort, sorted, sort_key, SORT_TOTAL);
+
+  fprintf(f, "# Percentiles of the self and total ticks per call.\n");
+  fprintf(f, "# The percentiles are upper bounds within %.1f%%, max is exact.\n",
+    100.0 / HISTOGRAM_SUB);
+
+  fprintf(f, "%-32s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+    "name", "invocation", "calls",
+    "self p50", "p99", "p99.9", "max",
+    "total p50", "p99", "p99.9", "max");
+
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    block_t *with_block = BLOCK(with, sort[iblock]);
+
+    histogram_t *with_self = with_block->block_self_histogram;
+    histogram_t *with_total = with_block->block_total_histogram;
+
+    fprintf(f, "%-32s %10d %10lld %10lld %10lld %10lld %10lld %10lld %10lld %10lld %10lld\n",
+      format_name(name, with_block->block_name),
+      with_block->block_invocation,
+      with_block->block_calls,
+      return_percentile(with_self, 0.50),
+      return_percentile(with_self, 0.99),
+      return_percentile(with_self, 0.999),
+      with_self->histogram_ticks_max,
+      return_percentile(with_total, 0.50),
+      return_percentile(with_total, 0.99),
+      return_percentile(with_total, 0.999),
+      with_total->histogram_ticks_max);
+  }
+  fprintf(f, "\n");
+
+  //the calls that are not sampled, only the sampled calls are in the
+  //histograms, with -DPROFILE_FLAT_RECURSION only the outermost calls are
+  //in the total histogram, the counted calls of a de-instrumented block are
+  //not extrapolated
+
+  int nsampled = 0;
+
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    if (with->profile_sample == 0) break;
+
+    block_t *with_block = BLOCK(with, sort[iblock]);
+
+    double mean, variance;
+
+    long long calls_sampled =
+      return_moments(with_block->block_total_histogram, &mean, &variance);
+
+    long long calls;
+
+    if (with->profile_flat_recursion)
+      calls = with_block->block_depth_calls[0] -
+              with_block->block_calls_outermost_deinstrumented;
+    else
+      calls = with_block->block_calls - with_block->block_calls_deinstrumented;
+
+    if (calls_sampled >= calls) continue;
+
+    if (nsampled++ == 0)
+    {
+      fprintf(f, "# Blocks with calls that are not sampled, their times are extrapolated.\n");
+      fprintf(f, "# The error is the standard error of the extrapolated total time.\n");
+
+      fprintf(f, "%-32s %10s %10s %10s %16s %16s %8s\n",
+        "name", "invocation", "calls", "sampled", "total time", "error", "error%");
+    }
+
+    //the standard error of the extrapolated total of all calls,
+    //with the finite population correction
+
+    long long calls_unsampled = calls - calls_sampled;
+
+    fprintf(f, "%-32s %10d %10lld %10lld %16.10f",
+      format_name(name, with_block->block_name),
+      with_block->block_invocation,
+      calls,
+      calls_sampled,
+      with_block->block_time_total);
+
+    //without sampled calls the time is unknown
+
+    if ((calls_sampled == 0) or (with_block->block_time_total <= 0.0))
+    {
+      fprintf(f, " %16s %8s\n", "-", "-");
+
+      continue;
+    }
+
+    double error = calls *
+                   sqrt(variance / calls_sampled *
+                        (double) calls_unsampled / calls) /
+                   with->profile_frequency;
+
+    fprintf(f, " %16.10f %8.2f\n",
+      error, error / with_block->block_time_total * 100);
+  }
+  if (nsampled > 0) fprintf(f, "\n");
+
+  if (with->profile_wall)
+  {
+    sort_blocks(with, sort, sorted, sort_key, SORT_OFF);
+
+    fprintf(f, "# Off-CPU time, the wall-clock time minus the CPU time, of the own code (self)\n");
+    fprintf(f, "# and of the block and children (total), sorted by off-CPU self time.\n");
+    fprintf(f, "# Time spent blocked, waiting or preempted shows up in the block where it happens.\n");
+
+    fprintf(f, "%-32s %10s %10s %16s %16s %16s %16s %6s\n",
+      "name", "invocation", "calls",
+      "self time", "off-CPU self", "total time", "off-CPU total", "off%");
+
+    for (int iblock = 0; iblock < with->nblock; iblock++)
+    {
+      block_t *with_block = BLOCK(with, sort[iblock]);
+
+      double time_wall = with_block->block_time_total +
+                         with_block->block_time_off_total;
+
+      fprintf(f, "%-32s %10d %10lld %16.10f %16.10f %16.10f %16.10f %6.2f\n",
+        format_name(name, with_block->block_name),
+        with_block->block_invocation,
+        with_block->block_calls,
+        with_block->block_time_self_total,
+        with_block->block_time_off_self,
+        with_block->block_time_total,
+        with_block->block_time_off_total,
+        time_wall > 0.0 ? with_block->block_time_off_total / time_wall * 100 : 0.0);
+    }
+    fprintf(f, "\n");
+
+    sort_blocks(with, sort, sorted, sort_key, SORT_TOTAL);
+  }
+
+  if (with->profile_flat_recursion)
+  {
+    fprintf(f, "# Calls per recursion depth of the recursive blocks.\n");
+    fprintf(f, "# The recursive invocations share a block, the total time is that of the\n");
+    fprintf(f, "# outermost calls.\n");
+
+    fprintf(f, "%-32s %10s", "name", "calls");
+
+    for (int idepth = 0; idepth < NDEPTH; idepth++)
+    {
+      char depth[NAME_MAX];
+
+      if (idepth == 0)
+        snprintf(depth, NAME_MAX, "1");
+      else if (idepth == NDEPTH - 1)
+        snprintf(depth, NAME_MAX, "%d+", 1 << idepth);
+      else
+        snprintf(depth, NAME_MAX, "%d-%d", 1 << idepth, (2 << idepth) - 1);
+
+      fprintf(f, " %10s", depth);
+    }
+
+    fprintf(f, "\n");
+
+    for (int iblock = 0; iblock < with->nblock; iblock++)
+    {
+      block_t *with_block = BLOCK(with, sort[iblock]);
+
+      if (with_block->block_calls == with_block->block_depth_calls[0]) continue;
+
+      fprintf(f, "%-32s %10lld", format_name(name, with_block->block_name),
+        with_block->block_calls);
+
+      for (int idepth = 0; idepth < NDEPTH; idepth++)
+        fprintf(f, " %10lld", with_block->block_depth_calls[idepth]);
+
+      fprintf(f, "\n");
+    }
+    fprintf(f, "\n");
+  }
+
+  int ndeinstrumented = 0;
+
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    block_t *with_block = BLOCK(with, sort[iblock]);
+
+    if (with_block->block_calls_deinstrumented == 0) continue;
+
+    if (ndeinstrumented++ == 0)
+    {
+      fprintf(f, "# Blocks with calls that were only counted, since the block or a caller\n");
+      fprintf(f, "# was switched to counts only when its mean total time per call was less\n");
+      fprintf(f, "# than %d times the intrinsic profile overhead. The time of the counted\n",
+        with->profile_deinstrument);
+      fprintf(f, "# calls is in the self time of the caller of the switched block.\n");
+
+      fprintf(f, "%-32s %10s %10s %10s %16s\n",
+        "name", "invocation", "calls", "counted", "timed ticks/call");
+    }
+
+    long long calls_timed = with_block->block_calls -
+                            with_block->block_calls_deinstrumented;
+
+    fprintf(f, "%-32s %10d %10lld %10lld %16lld\n",
+      format_name(name, with_block->block_name),
+      with_block->block_invocation,
+      with_block->block_calls,
+      with_block->block_calls_deinstrumented,
+      calls_timed > 0 ?
+        llround(with_block->block_time_total * with->profile_frequency / calls_timed) : 0);
+  }
+  if (ndeinstrumented > 0) fprintf(f, "\n");
+
+  if (with->profile_malloc)
+  {
+    sort_blocks(with, sort, sorted, sort_key, SORT_MALLOC);
+
+    fprintf(f, "# Allocations of the own code (self) and of the block and children (total),\n");
+    fprintf(f, "# sorted by the bytes allocated by the own code. realloc counts as an allocation.\n");
+
+    fprintf(f, "%-32s %10s %10s %12s %12s %12s %12s %12s %16s\n",
+      "name", "invocation", "calls",
+      "mallocs/call", "bytes/call", "frees/call",
+      "total m/call", "total b/call", "bytes");
+
+    for (int iblock = 0; iblock < with->nblock; iblock++)
+    {
+      block_t *with_block = BLOCK(with, sort[iblock]);
+
+      double calls = with_block->block_calls > 0 ? with_block->block_calls : 1;
+
+      fprintf(f, "%-32s %10d %10lld %12.2f %12.2f %12.2f %12.2f %12.2f %16lld\n",
+        format_name(name, with_block->block_name),
+        with_block->block_invocation,
+        with_block->block_calls,
+        with_block->block_mallocs_self / calls,
+        with_block->block_malloc_bytes_self / calls,
+        with_block->block_frees_self / calls,
+        with_block->block_mallocs_total / calls,
+        with_block->block_malloc_bytes_total / calls,
+        with_block->block_malloc_bytes_self);
+    }
+    fprintf(f, "\n");
+
+    sort_blocks(with, sort, sorted, sort_key, SORT_TOTAL);
+  }
+
+  if (with->profile_perf != 0)
+  {
+    fprintf(f, "# Hardware counters of the own code (self) and of the block and children (total).\n");
+    fprintf(f, "# The misses are per call, LLC, L1D and br(anch) of the own code.\n");
+    fprintf(f, "# Counters that could not be counted are shown as -.\n");
+
+    fprintf(f, "%-32s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+      "name", "invocation", "calls",
+      "self IPC", "total IPC", "LLC/call", "L1D/call", "br/call",
+      "total LLC");
+
+    for (int iblock = 0; iblock < with->nblock; iblock++)
+    {
+      block_t *with_block = BLOCK(with, sort[iblock]);
+
+      fprintf(f, "%-32s %10d %10lld",
+        format_name(name, with_block->block_name),
+        with_block->block_invocation,
+        with_block->block_calls);
+
+      print_ipc(f, with, with_block->block_perf_self);
+      print_ipc(f, with, with_block->block_perf_total);
+
+      print_per_call(f, with, with_block->block_perf_self, PERF_LLC_MISSES,
+        with_block->block_calls);
+      print_per_call(f, with, with_block->block_perf_self, PERF_L1D_MISSES,
+        with_block->block_calls);
+      print_per_call(f, with, with_block->block_perf_self, PERF_BRANCH_MISSES,
+        with_block->block_calls);
+      print_per_call(f, with, with_block->block_perf_total, PERF_LLC_MISSES,
+        with_block->block_calls);
+
+      fprintf(f, "\n");
+    }
+    fprintf(f, "\n");
+  }
+
+  if (verbose == 0) goto label_return;
+
+  sort_blocks(with, sort, sorted, sort_key, SORT_RECURSIVE);
+
+  edge_t *edges;
+
+  PROFILE_BUG((edges = malloc(with->nblock * sizeof(edge_t))) == NULL)
+
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    block_t *with_block = BLOCK(with, sort[iblock]);
+
+    fprintf(f, "# Summary for block %s, invocation %d.\n",
+      with_block->block_name, with_block->block_invocation);
+
+    fprintf(f, "Spends %.10f secs in %lld call(s), or %.2f%% of total execution time.\n",
+      with_block->block_time_total,
+      with_block->block_calls,
+      PERC(with_block->block_time_total));
+
+    fprintf(f, "Spends %.10f secs (%.2f%%) in own code, %.10f secs (%.2f%%) in children.\n",
+      with_block->block_time_self_total, PERC(with_block->block_time_self_total),
+      with_block->block_child_time_total, PERC(with_block->block_child_time_total));
+    fprintf(f, "\n");
+
+    int nedge = sort_edges(&(with_block->block_children), edges);
+
+    for (int iedge = 0; iedge < nedge; iedge++)
+    {
+      edge_t *with_child = edges + iedge;
+
+      fprintf(f, "Spends %.10f secs in %lld call(s) to %s, invocation %d",
+        with_child->edge_time_total,
+        with_child->edge_calls,
+        BLOCK(with, with_child->edge_id)->block_name,
+        BLOCK(with, with_child->edge_id)->block_invocation);
+
+      if (with->profile_wall)
+        fprintf(f, ", and %.10f secs off-CPU", with_child->edge_time_off_total);
+
+      fprintf(f, ".\n");
+    }
+
+    if (nedge == 0) fprintf(f, "No children were found.\n");
+
+    nedge = sort_edges(&(with_block->block_parents), edges);
+
+    for (int iedge = 0; iedge < nedge; iedge++)
+    {
+      edge_t *with_parent = edges + iedge;
+
+      fprintf(f, "Is called %lld time(s) from %s, invocation %d.\n",
+        with_parent->edge_calls,
+        BLOCK(with, with_parent->edge_id)->block_name,
+        BLOCK(with, with_parent->edge_id)->block_invocation);
+    }
+
+    if (nedge == 0) fprintf(f, "No parents were found\n");
+
+    fprintf(f, "\n");
+  }
+
+  free(edges);
+
+  label_return:
+
+  free(sorted);
+
+  free(sort);
+
+  fprintf(f, "# End of profile.\n");
+}
+
+
+//return the slot of block name, invocation in the hash table of with
+
+local int return_hash(profile_t *with, const char *name, int invocation)
+{
+  unsigned int mask = with->nhash - 1;
+  unsigned int ihash = hash_name(name, invocation) & mask;
+
+  while(with->hash[ihash] != PROFILE_INVALID)
+  {
+    block_t *with_block = BLOCK(with, with->hash[ihash]);
+
+    if ((with_block->block_invocation == invocation) &&
+        (strcmp(with_block->block_name, name) == 0)) break;
+
+    ihash = (ihash + 1) & mask;
+  }
+
+  return(ihash);
+}
+
+//keep the load factor of the hash table below one half
+
+local void grow_hash(profile_t *with, int nblock)
+{
+  if (2 * nblock <= with->nhash) return;
+
+  free(with->hash);
+
+  with->nhash = 2;
+
+  while(with->nhash < 2 * nblock) with->nhash *= 2;
+
+  PROFILE_BUG((with->hash = malloc(with->nhash * sizeof(int))) == NULL)
+
+  for (int ihash = 0; ihash < with->nhash; ihash++)
+    with->hash[ihash] = PROFILE_INVALID;
+
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    block_t *with_block = BLOCK(with, iblock);
+
+    with->hash[return_hash(with, with_block->block_name,
+                           with_block->block_invocation)] = iblock;
+  }
+}
+
+//return the id of block name, invocation in a merged profile, or
+//PROFILE_INVALID if the profile has no such block
+
+int find_block(profile_t *with, const char *name, int invocation)
+{
+  if (with->nhash == 0) return(PROFILE_INVALID);
+
+  return(with->hash[return_hash(with, name, invocation)]);
+}
+
+local void merge_edges(profile_t *merged, edges_t *with_merged,
+  edges_t *with_edges, int *map)
+{
+  for (int iedge = 0; iedge < with_edges->nedge_max; iedge++)
+  {
+    edge_t *with_edge = with_edges->edge + iedge;
+
+    if (with_edge->edge_id == PROFILE_INVALID) continue;
+
+    edge_t *with_merged_edge = return_edge(merged, with_merged, map[with_edge->edge_id]);
+
+    with_merged_edge->edge_calls += with_edge->edge_calls;
+
+    with_merged_edge->edge_time_total += with_edge->edge_time_total;
+
+    with_merged_edge->edge_time_off_total += with_edge->edge_time_off_total;
+  }
+}
+
+//merge the profile with into merged, blocks with the same name and
+//invocation are merged
+//with can be the profile of a single thread or a merged profile itself
+
+void merge_profile(profile_t *merged, profile_t *with)
+{
+  int nthread = (with->nmerged > 0) ? with->nmerged : 1;
+
+  if (merged->nmerged == 0)
+  {
+    memcpy(merged->profile_counter, with->profile_counter, NAME_MAX);
+    merged->profile_frequency = with->profile_frequency;
+    merged->profile_counter_mean = with->profile_counter_mean;
+    merged->profile_counter_sigma = with->profile_counter_sigma;
+    merged->profile_ncall = with->profile_ncall;
+    merged->profile_ncounter_largest = with->profile_ncounter_largest;
+    merged->profile_counter_largest = with->profile_counter_largest;
+    merged->profile_fixed_correction = with->profile_fixed_correction;
+    merged->profile_stamp = with->profile_stamp;
+    memcpy(merged->profile_host, with->profile_host, HOST_MAX);
+    merged->profile_process = with->profile_process;
+    merged->profile_rank = with->profile_rank;
+  }
+  else
+  {
+    //the profiles of several processes or hosts
+
+    if (strcmp(merged->profile_host, with->profile_host) != 0)
+      merged->profile_host[0] = '\0';
+
+    if (merged->profile_process != with->profile_process)
+    {
+      merged->profile_process = PROFILE_INVALID;
+      merged->profile_rank = PROFILE_INVALID;
+    }
+  }
+
+  merged->profile_perf |= with->profile_perf;
+
+  merged->profile_wall |= with->profile_wall;
+
+  merged->profile_malloc |= with->profile_malloc;
+
+  merged->profile_flat_recursion |= with->profile_flat_recursion;
+
+  if (with->profile_sample > merged->profile_sample)
+    merged->profile_sample = with->profile_sample;
+
+  if (with->profile_deinstrument > merged->profile_deinstrument)
+    merged->profile_deinstrument = with->profile_deinstrument;
+
+  merged->profile_counter_correction =
+    (merged->profile_counter_correction * merged->nmerged +
+     with->profile_counter_correction * nthread) / (merged->nmerged + nthread);
+
+  merged->nmerged += nthread;
+
+  merged->time_total += with->time_total;
+
+  if (with->nblock == 0) return;
+
+  grow_hash(merged, merged->nblock + with->nblock);
+
+  //map the block ids of with to merged block ids
+
+  int *map;
+
+  PROFILE_BUG((map = malloc(with->nblock * sizeof(int))) == NULL)
+
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    block_t *with_block = BLOCK(with, iblock);
+
+    int ihash = return_hash(merged, with_block->block_name,
+                            with_block->block_invocation);
+
+    //the minimum and maximum over the threads in with
+
+    int block_nthread = 1;
+
+    double time_self_min = with_block->block_time_self_total;
+    double time_self_max = with_block->block_time_self_total;
+    double time_total_min = with_block->block_time_total;
+    double time_total_max = with_block->block_time_total;
+
+    if (with->nmerged > 0)
+    {
+      block_nthread = with_block->block_nthread;
+
+      time_self_min = with_block->block_time_self_min;
+      time_self_max = with_block->block_time_self_max;
+      time_total_min = with_block->block_time_total_min;
+      time_total_max = with_block->block_time_total_max;
+    }
+
+    if (merged->hash[ihash] == PROFILE_INVALID)
+    {
+      merged->hash[ihash] = add_block(merged);
+
+      block_t *with_merged_block = BLOCK(merged, merged->hash[ihash]);
+
+      with_merged_block->block_name = with_block->block_name;
+
+      with_merged_block->block_invocation = with_block->block_invocation;
+
+      with_merged_block->block_invocation_pointer = NULL;
+
+      with_merged_block->block_nthread = 0;
+
+      with_merged_block->block_time_self_min = time_self_min;
+      with_merged_block->block_time_self_max = time_self_max;
+
+      with_merged_block->block_time_total_min = time_total_min;
+      with_merged_block->block_time_total_max = time_total_max;
+    }
+
+    map[iblock] = merged->hash[ihash];
+
+    block_t *with_merged_block = BLOCK(merged, map[iblock]);
+
+    with_merged_block->block_nthread += block_nthread;
+
+    with_merged_block->block_calls += with_block->block_calls;
+
+    with_merged_block->block_time_self_total += with_block->block_time_self_total;
+
+    with_merged_block->block_time_total += with_block->block_time_total;
+
+    if (time_self_min < with_merged_block->block_time_self_min)
+      with_merged_block->block_time_self_min = time_self_min;
+    if (time_self_max > with_merged_block->block_time_self_max)
+      with_merged_block->block_time_self_max = time_self_max;
+
+    if (time_total_min < with_merged_block->block_time_total_min)
+      with_merged_block->block_time_total_min = time_total_min;
+    if (time_total_max > with_merged_block->block_time_total_max)
+      with_merged_block->block_time_total_max = time_total_max;
+  }
+
+  //merge the call graph
+
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    block_t *with_block = BLOCK(with, iblock);
+
+    block_t *with_merged_block = BLOCK(merged, map[iblock]);
+
+    merge_edges(merged, &(with_merged_block->block_parents),
+                &(with_block->block_parents), map);
+
+    merge_edges(merged, &(with_merged_block->block_children),
+                &(with_block->block_children), map);
+
+    merge_histogram(with_merged_block->block_self_histogram,
+                    with_block->block_self_histogram);
+
+    merge_histogram(with_merged_block->block_total_histogram,
+                    with_block->block_total_histogram);
+
+    for (int iperf = 0; iperf < NPERF; iperf++)
+    {
+      with_merged_block->block_perf_self[iperf] += with_block->block_perf_self[iperf];
+      with_merged_block->block_perf_total[iperf] += with_block->block_perf_total[iperf];
+    }
+
+    with_merged_block->block_time_off_self += with_block->block_time_off_self;
+    with_merged_block->block_time_off_total += with_block->block_time_off_total;
+
+    with_merged_block->block_mallocs_self += with_block->block_mallocs_self;
+    with_merged_block->block_malloc_bytes_self += with_block->block_malloc_bytes_self;
+    with_merged_block->block_frees_self += with_block->block_frees_self;
+    with_merged_block->block_mallocs_total += with_block->block_mallocs_total;
+    with_merged_block->block_malloc_bytes_total += with_block->block_malloc_bytes_total;
+
+    for (int idepth = 0; idepth < NDEPTH; idepth++)
+      with_merged_block->block_depth_calls[idepth] += with_block->block_depth_calls[idepth];
+
+    with_merged_block->block_calls_deinstrumented +=
+      with_block->block_calls_deinstrumented;
+    with_merged_block->block_calls_outermost_deinstrumented +=
+      with_block->block_calls_outermost_deinstrumented;
+  }
+
+  //keep the blocks that are not terminated
+
+  if (with->nstack > 0)
+  {
+    PROFILE_BUG((merged->stack = realloc(merged->stack,
+      (merged->nstack + with->nstack) * sizeof(int))) == NULL)
+
+    for (int istack = 0; istack < with->nstack; istack++)
+      merged->stack[merged->nstack++] = map[with->stack[istack]];
+  }
+
+  free(map);
+}
+
+//the sigma of the intrinsic profile overhead in seconds, but at least a tick
+
+local double return_sigma(profile_t *with)
+{
+  return((with->profile_counter_sigma > 1 ? with->profile_counter_sigma : 1) /
+         (double) with->profile_frequency);
+}
+
+#define DIFF_PERC(A, B) ((A) > 0.0 ? 100.0 * ((B) - (A)) / (A) : 0.0)
+
+//compare the blocks of two merged profiles matched by name and invocation
+//a change of the self time is marked '+' (slower) or '-' (faster) if it is
+//larger than nsigma times the sigma of the intrinsic profile overhead of
+//both profiles per call
+//the profiles should be measured with the same counter, the ticks per call
+//are those of the frequency of each profile
+
+void diff_profile(FILE *f, profile_t *before, profile_t *after, double nsigma)
+{
+  if (strcmp(before->profile_counter, after->profile_counter) != 0)
+  {
+    fprintf(stderr, "the profiles were measured with different counters, "
+                    "%s and %s\n", before->profile_counter, after->profile_counter);
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(f, "# The counter is %s.\n", after->profile_counter);
+  if (before->profile_frequency != after->profile_frequency)
+    fprintf(f, "# The frequency is %lld ticks before and %lld ticks after, "
+               "the ticks per call are not comparable.\n",
+      before->profile_frequency, after->profile_frequency);
+  fprintf(f, "# The sigma of the intrinsic profile overhead is %lld ticks before "
+             "and %lld ticks after.\n",
+    before->profile_counter_sigma, after->profile_counter_sigma);
+  fprintf(f, "# Changes of the self time of less than %.1f sigma per call "
+             "are not marked.\n", nsigma);
+  fprintf(f, "# The total run time was %.10f secs before and %.10f secs after.\n",
+    before->time_total, after->time_total);
+  fprintf(f, "\n");
+
+  //the blocks of after and then the blocks that are only in before
+
+  int nrow = after->nblock + before->nblock;
+
+  sorted_t *sorted;
+
+  PROFILE_BUG((sorted = malloc((nrow > 0 ? nrow : 1) * sizeof(sorted_t))) == NULL)
+
+  int *map;
+
+  PROFILE_BUG((map = malloc((nrow > 0 ? nrow : 1) * sizeof(int))) == NULL)
+
+  block_t empty;
+
+  memset(&empty, 0, sizeof(block_t));
+
+  nrow = 0;
+
+  for (int iblock = 0; iblock < after->nblock; iblock++)
+  {
+    block_t *with_block = BLOCK(after, iblock);
+
+    int jblock = find_block(before, with_block->block_name,
+                            with_block->block_invocation);
+
+    block_t *with_before = jblock == PROFILE_INVALID ? &empty : BLOCK(before, jblock);
+
+    map[nrow] = jblock;
+
+    sorted[nrow].sorted_value =
+      fabs(with_block->block_time_self_total - with_before->block_time_self_total);
+    sorted[nrow].sorted_id = nrow;
+
+    nrow++;
+  }
+
+  for (int jblock = 0; jblock < before->nblock; jblock++)
+  {
+    block_t *with_before = BLOCK(before, jblock);
+
+    if (find_block(after, with_before->block_name,
+                   with_before->block_invocation) != PROFILE_INVALID) continue;
+
+    map[nrow] = jblock;
+
+    sorted[nrow].sorted_value = with_before->block_time_self_total;
+    sorted[nrow].sorted_id = nrow;
+
+    nrow++;
+  }
+
+  qsort(sorted, nrow, sizeof(sorted_t), compare_sorted);
+
+  fprintf(f, "# Blocks sorted by the change of the self time.\n");
+
+  fprintf(f, "%-32s %-10s %10s %10s %16s %16s %8s %8s %10s %10s %4s\n",
+    "name", "invocation", "calls", "calls",
+    "self time", "self time", "self%", "total%",
+    "ticks/call", "ticks/call", "");
+
+  fprintf(f, "%-32s %-10s %10s %10s %16s %16s %8s %8s %10s %10s %4s\n",
+    "", "", "before", "after", "before", "after", "", "", "before", "after", "");
+
+  for (int irow = 0; irow < nrow; irow++)
+  {
+    int krow = sorted[irow].sorted_id;
+
+    block_t *with_before;
+    block_t *with_after;
+
+    if (krow < after->nblock)
+    {
+      with_after = BLOCK(after, krow);
+      with_before = map[krow] == PROFILE_INVALID ? &empty : BLOCK(before, map[krow]);
+    }
+    else
+    {
+      with_before = BLOCK(before, map[krow]);
+      with_after = &empty;
+    }
+
+    char name[NAME_MAX];
+
+    format_name(name, with_after == &empty ? with_before->block_name :
+                                             with_after->block_name);
+    int invocation = with_after == &empty ? with_before->block_invocation :
+                                            with_after->block_invocation;
+
+    double ticks_before = 0.0;
+    double ticks_after = 0.0;
+
+    if (with_before->block_calls > 0)
+      ticks_before = with_before->block_time_self_total *
+                     before->profile_frequency / with_before->block_calls;
+
+    if (with_after->block_calls > 0)
+      ticks_after = with_after->block_time_self_total *
+                    after->profile_frequency / with_after->block_calls;
+
+    //every call can be off by the sigma of both profiles
+
+    double delta = with_after->block_time_self_total -
+                   with_before->block_time_self_total;
+
+    long long calls = with_before->block_calls > with_after->block_calls ?
+                      with_before->block_calls : with_after->block_calls;
+
+    double noise = nsigma * hypot(return_sigma(before), return_sigma(after)) *
+                   calls;
+
+    int significant = fabs(delta) > noise;
+
+    const char *mark = "";
+
+    if (with_before == &empty)
+      mark = "new";
+    else if (with_after == &empty)
+      mark = "gone";
+    else if (significant)
+      mark = delta > 0.0 ? "+" : "-";
+
+    fprintf(f, "%-32s %-10d %10lld %10lld %16.10f %16.10f %8.2f %8.2f "
+               "%10.0f %10.0f %4s\n",
+      name, invocation,
+      with_before->block_calls, with_after->block_calls,
+      with_before->block_time_self_total, with_after->block_time_self_total,
+      DIFF_PERC(with_before->block_time_self_total,
+                with_after->block_time_self_total),
+      DIFF_PERC(with_before->block_time_total, with_after->block_time_total),
+      ticks_before, ticks_after, mark);
+  }
+  fprintf(f, "\n");
+
+  free(map);
+  free(sorted);
+}
+
+void free_profile(profile_t *with)
+{
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    block_t *with_block = BLOCK(with, iblock);
+
+    free(with_block->block_parents.edge);
+    free(with_block->block_children.edge);
+
+    free(with_block->block_self_histogram);
+    free(with_block->block_total_histogram);
+  }
+
+  for (int ichunk = 0; ichunk < PROFILE_CHUNK_MAX; ichunk++)
+    free(with->block_chunk[ichunk]);
+
+  free(with->stack);
+
+  free(with->hash);
+
+  for (int iretired = 0; iretired < with->nretired; iretired++)
+    free(with->retired[iretired]);
+
+  free(with->retired);
+
+  memset(with, 0, sizeof(profile_t));
+}
+
+//binary profiles
+//the file is a file_header_t followed by the ids of the blocks that are not
+//terminated, the blocks, the edges of the blocks (first the parents and then
+//the children of each block), the non-empty buckets of the histograms of the
+//blocks (first self and then total) and the block names, each terminated
+//by a '\0'
+//the file holds the raw structs in the byte order and alignment of the
+//machine that wrote it, so it can only be read on the same kind of machine,
+//the ids of the blocks are padded to a multiple of 8 bytes, so the structs
+//that follow them stay aligned
+//the file is written by a single write
+
+#define FILE_MAGIC   "GWP"
+#define FILE_VERSION 10
+
+#define FILE_ALIGN 8
+
+#define FILE_STACK_SIZE(N) \
+  (((size_t) (N) * sizeof(int) + FILE_ALIGN - 1) & ~((size_t) FILE_ALIGN - 1))
+
+typedef struct
+{
+  char file_magic[4];
+  int file_version;
+
+  char file_counter[NAME_MAX];
+  long long file_frequency;
+  long long file_counter_mean;
+  long long file_counter_sigma;
+  long long file_ncall;
+  long long file_ncounter_largest;
+  long long file_counter_largest;
+  int file_fixed_correction;
+  double file_counter_correction;
+  long long file_stamp;
+  char file_host[HOST_MAX];
+  int file_process;
+  int file_rank;
+  int file_perf;
+  int file_wall;
+  int file_malloc;
+  int file_flat_recursion;
+  int file_sample;
+  int file_deinstrument;
+
+  int file_nmerged;
+  double file_time_total;
+
+  int file_nstack;
+  int file_nblock;
+  long long file_nedge;
+  long long file_nbucket;
+  long long file_nname;
+} file_header_t;
+
+typedef struct
+{
+  long long file_name;
+  int file_invocation;
+  int file_nthread;
+
+  long long file_calls;
+
+  double file_time_self_total;
+  double file_time_total;
+
+  double file_time_self_min;
+  double file_time_self_max;
+  double file_time_total_min;
+  double file_time_total_max;
+
+  int file_nparent;
+  int file_nchild;
+
+  long long file_self_max;
+  long long file_total_max;
+
+  int file_nself;
+  int file_ntotal;
+
+  long long file_perf_self[NPERF];
+  long long file_perf_total[NPERF];
+
+  double file_time_off_self;
+  double file_time_off_total;
+
+  long long file_mallocs_self;
+  long long file_malloc_bytes_self;
+  long long file_frees_self;
+  long long file_mallocs_total;
+  long long file_malloc_bytes_total;
+
+  long long file_depth_calls[NDEPTH];
+
+  long long file_calls_deinstrumented;
+  long long file_calls_outermost_deinstrumented;
+} file_block_t;
+
+typedef struct
+{
+  int file_id;
+  long long file_calls;
+  double file_time_total;
+  double file_time_off_total;
+} file_edge_t;
+
+typedef struct
+{
+  int file_bucket;
+  long long file_count;
+} file_bucket_t;
+
+local file_edge_t *write_edges(file_edge_t *with_file_edge, edges_t *with_edges)
+{
+  for (int iedge = 0; iedge < with_edges->nedge_max; iedge++)
+  {
+    edge_t *with_edge = with_edges->edge + iedge;
+
+    if (with_edge->edge_id == PROFILE_INVALID) continue;
+
+    with_file_edge->file_id = with_edge->edge_id;
+    with_file_edge->file_calls = with_edge->edge_calls;
+    with_file_edge->file_time_total = with_edge->edge_time_total;
+    with_file_edge->file_time_off_total = with_edge->edge_time_off_total;
+
+    with_file_edge++;
+  }
+
+  return(with_file_edge);
+}
+
+local int return_nbucket(histogram_t *with_histogram)
+{
+  int result = 0;
+
+  for (int ibucket = 0; ibucket < NHISTOGRAM; ibucket++)
+    if (with_histogram->histogram_count[ibucket] > 0) result++;
+
+  return(result);
+}
+
+local file_bucket_t *write_histogram(file_bucket_t *with_file_bucket,
+  histogram_t *with_histogram)
+{
+  for (int ibucket = 0; ibucket < NHISTOGRAM; ibucket++)
+  {
+    if (with_histogram->histogram_count[ibucket] == 0) continue;
+
+    with_file_bucket->file_bucket = ibucket;
+    with_file_bucket->file_count = with_histogram->histogram_count[ibucket];
+
+    with_file_bucket++;
+  }
+
+  return(with_file_bucket);
+}
+
+void write_profile(const char *name, profile_t *with)
+{
+  long long nedge = 0;
+  long long nbucket = 0;
+  long long nname = 0;
+
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    block_t *with_block = BLOCK(with, iblock);
+
+    nedge += with_block->block_parents.nedge + with_block->block_children.nedge;
+
+    nbucket += return_nbucket(with_block->block_self_histogram) +
+               return_nbucket(with_block->block_total_histogram);
+
+    nname += strlen(with_block->block_name) + 1;
+  }
+
+  size_t nbytes = sizeof(file_header_t) +
+                  FILE_STACK_SIZE(with->nstack) +
+                  with->nblock * sizeof(file_block_t) +
+                  nedge * sizeof(file_edge_t) +
+                  nbucket * sizeof(file_bucket_t) +
+                  nname;
+
+  char *buffer;
+
+  PROFILE_BUG((buffer = calloc(nbytes, 1)) == NULL)
+
+  file_header_t *with_header = (file_header_t *) buffer;
+
+  memcpy(with_header->file_magic, FILE_MAGIC, sizeof(with_header->file_magic));
+  with_header->file_version = FILE_VERSION;
+
+  memcpy(with_header->file_counter, with->profile_counter, NAME_MAX);
+  memcpy(with_header->file_host, with->profile_host, HOST_MAX);
+  with_header->file_process = with->profile_process;
+  with_header->file_rank = with->profile_rank;
+  with_header->file_frequency = with->profile_frequency;
+  with_header->file_counter_mean = with->profile_counter_mean;
+  with_header->file_counter_sigma = with->profile_counter_sigma;
+  with_header->file_ncall = with->profile_ncall;
+  with_header->file_ncounter_largest = with->profile_ncounter_largest;
+  with_header->file_counter_largest = with->profile_counter_largest;
+  with_header->file_fixed_correction = with->profile_fixed_correction;
+  with_header->file_counter_correction = with->profile_counter_correction;
+  with_header->file_stamp = with->profile_stamp;
+  with_header->file_perf = with->profile_perf;
+  with_header->file_wall = with->profile_wall;
+  with_header->file_malloc = with->profile_malloc;
+  with_header->file_flat_recursion = with->profile_flat_recursion;
+  with_header->file_sample = with->profile_sample;
+  with_header->file_deinstrument = with->profile_deinstrument;
+
+  with_header->file_nmerged = with->nmerged;
+  with_header->file_time_total = with->time_total;
+
+  with_header->file_nstack = with->nstack;
+  with_header->file_nblock = with->nblock;
+  with_header->file_nedge = nedge;
+  with_header->file_nbucket = nbucket;
+  with_header->file_nname = nname;
+
+  int *stack = (int *) (with_header + 1);
+
+  for (int istack = 0; istack < with->nstack; istack++)
+    stack[istack] = with->stack[istack];
+
+  file_block_t *file_blocks = (file_block_t *)
+    ((char *) stack + FILE_STACK_SIZE(with->nstack));
+
+  file_edge_t *with_file_edge = (file_edge_t *) (file_blocks + with->nblock);
+
+  file_bucket_t *with_file_bucket = (file_bucket_t *) (with_file_edge + nedge);
+
+  char *names = (char *) (with_file_bucket + nbucket);
+
+  long long iname = 0;
+
+  for (int iblock = 0; iblock < with->nblock; iblock++)
+  {
+    block_t *with_block = BLOCK(with, iblock);
+
+    file_block_t *with_file_block = file_blocks + iblock;
+
+    with_file_block->file_name = iname;
+    with_file_block->file_invocation = with_block->block_invocation;
+    with_file_block->file_nthread = with_block->block_nthread;
+
+    with_file_block->file_calls = with_block->block_calls;
+
+    with_file_block->file_time_self_total = with_block->block_time_self_total;
+    with_file_block->file_time_total = with_block->block_time_total;
+
+    with_file_block->file_time_self_min = with_block->block_time_self_min;
+    with_file_block->file_time_self_max = with_block->block_time_self_max;
+    with_file_block->file_time_total_min = with_block->block_time_total_min;
+    with_file_block->file_time_total_max = with_block->block_time_total_max;
+
+    with_file_block->file_nparent = with_block->block_parents.nedge;
+    with_file_block->file_nchild = with_block->block_children.nedge;
+
+    with_file_block->file_self_max =
+      with_block->block_self_histogram->histogram_ticks_max;
+    with_file_block->file_total_max =
+      with_block->block_total_histogram->histogram_ticks_max;
+
+    with_file_block->file_nself = return_nbucket(with_block->block_self_histogram);
+    with_file_block->file_ntotal = return_nbucket(with_block->block_total_histogram);
+
+    for (int iperf = 0; iperf < NPERF; iperf++)
+    {
+      with_file_block->file_perf_self[iperf] = with_block->block_perf_self[iperf];
+      with_file_block->file_perf_total[iperf] = with_block->block_perf_total[iperf];
+    }
+
+    with_file_block->file_time_off_self = with_block->block_time_off_self;
+    with_file_block->file_time_off_total = with_block->block_time_off_total;
+
+    with_file_block->file_mallocs_self = with_block->block_mallocs_self;
+    with_file_block->file_malloc_bytes_self = with_block->block_malloc_bytes_self;
+    with_file_block->file_frees_self = with_block->block_frees_self;
+    with_file_block->file_mallocs_total = with_block->block_mallocs_total;
+    with_file_block->file_malloc_bytes_total = with_block->block_malloc_bytes_total;
+
+    for (int idepth = 0; idepth < NDEPTH; idepth++)
+      with_file_block->file_depth_calls[idepth] = with_block->block_depth_calls[idepth];
+
+    with_file_block->file_calls_deinstrumented = with_block->block_calls_deinstrumented;
+    with_file_block->file_calls_outermost_deinstrumented =
+      with_block->block_calls_outermost_deinstrumented;
+
+    with_file_edge = write_edges(with_file_edge, &(with_block->block_parents));
+    with_file_edge = write_edges(with_file_edge, &(with_block->block_children));
+
+    with_file_bucket = write_histogram(with_file_bucket,
+                                       with_block->block_self_histogram);
+    with_file_bucket = write_histogram(with_file_bucket,
+                                       with_block->block_total_histogram);
+
+    strcpy(names + iname, with_block->block_name);
+
+    iname += strlen(with_block->block_name) + 1;
+  }
+
+  int fd;
+
+  PROFILE_BUG((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+
+  for (size_t nwritten = 0; nwritten < nbytes; )
+  {
+    ssize_t n = write(fd, buffer + nwritten, nbytes - nwritten);
+
+    PROFILE_BUG(n <= 0)
+
+    nwritten += n;
+  }
+
+  PROFILE_BUG(close(fd) != 0)
+
+  free(buffer);
+}
+
+//a binary profile whose counts or ids do not match its size
+
+local void corrupt_profile(const char *name)
+{
+  fprintf(stderr, "%s is corrupt\n", name);
+  exit(EXIT_FAILURE);
+}
+
+local void read_edges(const char *name, profile_t *with, edges_t *with_edges,
+  file_edge_t *with_file_edge, int nedge, int nblock)
+{
+  for (int iedge = 0; iedge < nedge; iedge++, with_file_edge++)
+  {
+    if ((with_file_edge->file_id < 0) or (with_file_edge->file_id >= nblock))
+      corrupt_profile(name);
+
+    edge_t *with_edge = return_edge(with, with_edges, with_file_edge->file_id);
+
+    with_edge->edge_calls = with_file_edge->file_calls;
+    with_edge->edge_time_total = with_file_edge->file_time_total;
+    with_edge->edge_time_off_total = with_file_edge->file_time_off_total;
+  }
+}
+
+local void read_histogram(const char *name, histogram_t *with_histogram,
+  file_bucket_t *with_file_bucket, int nbucket, long long ticks_max)
+{
+  for (int ibucket = 0; ibucket < nbucket; ibucket++, with_file_bucket++)
+  {
+    if ((with_file_bucket->file_bucket < 0) or
+        (with_file_bucket->file_bucket >= NHISTOGRAM))
+      corrupt_profile(name);
+
+    with_histogram->histogram_count[with_file_bucket->file_bucket] =
+      with_file_bucket->file_count;
+  }
+
+  with_histogram->histogram_ticks_max = ticks_max;
+}
+
+//read the binary profile name into the cleared profile with
+
+void read_profile(const char *name, profile_t *with)
+{
+  FILE *f;
+
+  if ((f = fopen(name, "rb")) == NULL)
+  {
+    fprintf(stderr, "cannot open %s\n", name);
+    exit(EXIT_FAILURE);
+  }
+
+  PROFILE_BUG(fseek(f, 0, SEEK_END) != 0)
+
+  long nbytes = ftell(f);
+
+  PROFILE_BUG(nbytes < 0)
+
+  rewind(f);
+
+  char *buffer;
+
+  PROFILE_BUG((buffer = malloc(nbytes + 1)) == NULL)
+
+  PROFILE_BUG(fread(buffer, 1, nbytes, f) != (size_t) nbytes)
+
+  fclose(f);
+
+  file_header_t *with_header = (file_header_t *) buffer;
+
+  if (((size_t) nbytes < sizeof(file_header_t)) ||
+      (memcmp(with_header->file_magic, FILE_MAGIC, sizeof(with_header->file_magic)) != 0))
+  {
+    fprintf(stderr, "%s is not a binary profile\n", name);
+    exit(EXIT_FAILURE);
+  }
+
+  if (with_header->file_version != FILE_VERSION)
+  {
+    fprintf(stderr, "%s has version %d, expected version %d\n",
+      name, with_header->file_version, FILE_VERSION);
+    exit(EXIT_FAILURE);
+  }
+
+  //the counts are checked one by one against the size, so their sum
+  //cannot overflow
+
+  if ((with_header->file_nstack < 0) or (with_header->file_nblock < 0) or
+      (with_header->file_nedge < 0) or (with_header->file_nbucket < 0) or
+      (with_header->file_nname < 0) or
+      (with_header->file_nstack > nbytes / (long) sizeof(int)) or
+      (with_header->file_nblock > nbytes / (long) sizeof(file_block_t)) or
+      (with_header->file_nedge > nbytes / (long) sizeof(file_edge_t)) or
+      (with_header->file_nbucket > nbytes / (long) sizeof(file_bucket_t)) or
+      (with_header->file_nname > nbytes))
+    corrupt_profile(name);
+
+  if ((size_t) nbytes != sizeof(file_header_t) +
+                         FILE_STACK_SIZE(with_header->file_nstack) +
+                         with_header->file_nblock * sizeof(file_block_t) +
+                         with_header->file_nedge * sizeof(file_edge_t) +
+                         with_header->file_nbucket * sizeof(file_bucket_t) +
+                         with_header->file_nname)
+    corrupt_profile(name);
+
+  int nblock = with_header->file_nblock;
+
+  memset(with, 0, sizeof(profile_t));
+
+  memcpy(with->profile_counter, with_header->file_counter, NAME_MAX);
+  with->profile_counter[NAME_MAX - 1] = '\0';
+  memcpy(with->profile_host, with_header->file_host, HOST_MAX);
+  with->profile_host[HOST_MAX - 1] = '\0';
+  with->profile_process = with_header->file_process;
+  with->profile_rank = with_header->file_rank;
+  with->profile_frequency = with_header->file_frequency;
+  with->profile_counter_mean = with_header->file_counter_mean;
+  with->profile_counter_sigma = with_header->file_counter_sigma;
+  with->profile_ncall = with_header->file_ncall;
+  with->profile_ncounter_largest = with_header->file_ncounter_largest;
+  with->profile_counter_largest = with_header->file_counter_largest;
+  with->profile_fixed_correction = with_header->file_fixed_correction;
+  with->profile_counter_correction = with_header->file_counter_correction;
+  with->profile_stamp = with_header->file_stamp;
+  with->profile_perf = with_header->file_perf;
+  with->profile_wall = with_header->file_wall;
+  with->profile_malloc = with_header->file_malloc;
+  with->profile_flat_recursion = with_header->file_flat_recursion;
+  with->profile_sample = with_header->file_sample;
+  with->profile_deinstrument = with_header->file_deinstrument;
+
+  with->nmerged = with_header->file_nmerged;
+  with->time_total = with_header->file_time_total;
+
+  int *stack = (int *) (with_header + 1);
+
+  with->nstack = with_header->file_nstack;
+
+  PROFILE_BUG((with->stack = malloc((with->nstack + 1) * sizeof(int))) == NULL)
+
+  for (int istack = 0; istack < with->nstack; istack++)
+  {
+    if ((stack[istack] < 0) or (stack[istack] >= nblock))
+      corrupt_profile(name);
+
+    with->stack[istack] = stack[istack];
+  }
+
+  file_block_t *file_blocks = (file_block_t *)
+    ((char *) stack + FILE_STACK_SIZE(with->nstack));
+
+  file_edge_t *with_file_edge =
+    (file_edge_t *) (file_blocks + with_header->file_nblock);
+
+  file_bucket_t *with_file_bucket =
+    (file_bucket_t *) (with_file_edge + with_header->file_nedge);
+
+  char *names = (char *) (with_file_bucket + with_header->file_nbucket);
+
+  names[with_header->file_nname] = '\0';
+
+  //the running offsets of the edges and buckets of the blocks
+
+  long long iedge = 0;
+  long long ibucket = 0;
+
+  for (int iblock = 0; iblock < nblock; iblock++)
+  {
+    file_block_t *with_file_block = file_blocks + iblock;
+
+    if ((with_file_block->file_name < 0) or
+        (with_file_block->file_name >= with_header->file_nname) or
+        (with_file_block->file_nparent < 0) or
+        (with_file_block->file_nchild < 0) or
+        (with_file_block->file_nself < 0) or
+        (with_file_block->file_ntotal < 0))
+      corrupt_profile(name);
+
+    iedge += (long long) with_file_block->file_nparent +
+             with_file_block->file_nchild;
+    ibucket += (long long) with_file_block->file_nself +
+               with_file_block->file_ntotal;
+
+    if ((iedge > with_header->file_nedge) or
+        (ibucket > with_header->file_nbucket))
+      corrupt_profile(name);
+
+    int block_id = add_block(with);
+
+    block_t *with_block = BLOCK(with, block_id);
+
+    with_block->block_name = intern_name(names + with_file_block->file_name);
+    with_block->block_invocation = with_file_block->file_invocation;
+    with_block->block_invocation_pointer = NULL;
+    with_block->block_nthread = with_file_block->file_nthread;
+
+    with_block->block_calls = with_file_block->file_calls;
+
+    with_block->block_time_self_total = with_file_block->file_time_self_total;
+    with_block->block_time_total = with_file_block->file_time_total;
+
+    with_block->block_time_self_min = with_file_block->file_time_self_min;
+    with_block->block_time_self_max = with_file_block->file_time_self_max;
+    with_block->block_time_total_min = with_file_block->file_time_total_min;
+    with_block->block_time_total_max = with_file_block->file_time_total_max;
+
+    for (int iperf = 0; iperf < NPERF; iperf++)
+    {
+      with_block->block_perf_self[iperf] = with_file_block->file_perf_self[iperf];
+      with_block->block_perf_total[iperf] = with_file_block->file_perf_total[iperf];
+    }
+
+    with_block->block_time_off_self = with_file_block->file_time_off_self;
+    with_block->block_time_off_total = with_file_block->file_time_off_total;
+
+    with_block->block_mallocs_self = with_file_block->file_mallocs_self;
+    with_block->block_malloc_bytes_self = with_file_block->file_malloc_bytes_self;
+    with_block->block_frees_self = with_file_block->file_frees_self;
+    with_block->block_mallocs_total = with_file_block->file_mallocs_total;
+    with_block->block_malloc_bytes_total = with_file_block->file_malloc_bytes_total;
+
+    for (int idepth = 0; idepth < NDEPTH; idepth++)
+      with_block->block_depth_calls[idepth] = with_file_block->file_depth_calls[idepth];
+
+    with_block->block_calls_deinstrumented = with_file_block->file_calls_deinstrumented;
+    with_block->block_calls_outermost_deinstrumented =
+      with_file_block->file_calls_outermost_deinstrumented;
+
+    read_edges(name, with, &(with_block->block_parents), with_file_edge,
+               with_file_block->file_nparent, nblock);
+
+    with_file_edge += with_file_block->file_nparent;
+
+    read_edges(name, with, &(with_block->block_children), with_file_edge,
+               with_file_block->file_nchild, nblock);
+
+    with_file_edge += with_file_block->file_nchild;
+
+    read_histogram(name, with_block->block_self_histogram, with_file_bucket,
+                   with_file_block->file_nself, with_file_block->file_self_max);
+
+    with_file_bucket += with_file_block->file_nself;
+
+    read_histogram(name, with_block->block_total_histogram, with_file_bucket,
+                   with_file_block->file_ntotal, with_file_block->file_total_max);
+
+    with_file_bucket += with_file_block->file_ntotal;
+  }
+
+  free(buffer);
+}
@@ -0,0 +1,157 @@
+#ifndef ProfileReportH
+#define ProfileReportH
+
+//the internals of the profile data and the reports, shared by profile.c and
+//the offline reporter gwp-report
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "profile_data.h"
+
+#define PROFILE_BUG(X) if (X)\
+  {fprintf(stderr, "%s::%ld:%s\n", __FILE__, (long) __LINE__, #X); exit(EXIT_FAILURE);}
+
+#define local static
+#define FALSE 0
+#define TRUE  1
+#define or    ||
+
+#define NAME_MAX  PROFILE_NAME_MAX
+#define HOST_MAX  PROFILE_HOST_MAX
+
+//sort keys of the reports
+
+#define SORT_DEFAULT 0
+#define SORT_CALLS   1
+#define SORT_SELF    2
+#define SORT_TOTAL   3
+
+void *new_chunk(int, int, size_t);
+const char *intern_name(const char *);
+const char *format_name(char *, const char *);
+void clear_edges(edges_t *);
+void grow_edges(profile_t *, edges_t *);
+void clear_block(block_t *);
+int add_block(profile_t *);
+void clear_histogram(histogram_t *);
+void merge_histogram(histogram_t *, histogram_t *);
+void report_profile(FILE *, profile_t *, int, int);
+void merge_profile(profile_t *, profile_t *);
+void diff_profile(FILE *, profile_t *, profile_t *, double);
+void write_profile(const char *, profile_t *);
+void read_profile(const char *, profile_t *);
+
+//the live export of -DPROFILE_SHM, a POSIX shared-memory segment that
+//gwp-top attaches read-only
+//the header is followed by shm_nthread_max thread slots of an shm_thread_t
+//and shm_nblock_max shm_block_t's, shm_magic is written last
+//shm_generation of a slot is incremented when the slot is reused by a new
+//thread or when the counters are reset, the counters are updated without
+//synchronization, so a reader can see the counters of a block torn
+
+#define SHM_MAGIC   0x53505747
+#define SHM_VERSION 1
+
+typedef struct
+{
+  int shm_magic;
+  int shm_version;
+  int shm_size_block;
+  int shm_nthread_max;
+  int shm_nblock_max;
+  int shm_pid;
+  char shm_counter[NAME_MAX];
+} shm_header_t;
+
+typedef struct
+{
+  int shm_generation;
+  int shm_nblock;
+} shm_thread_t;
+
+typedef struct
+{
+  char shm_name[NAME_MAX];
+  int shm_invocation;
+  long long shm_calls;
+  double shm_time_self_total;
+  double shm_time_total;
+} shm_block_t;
+
+#define SHM_SIZE_THREAD(H) \
+  (sizeof(shm_thread_t) + (size_t) (H)->shm_nblock_max * sizeof(shm_block_t))
+
+#define SHM_SIZE(H) \
+  (sizeof(shm_header_t) + (size_t) (H)->shm_nthread_max * SHM_SIZE_THREAD(H))
+
+#define SHM_THREAD(H, I) ((shm_thread_t *) \
+  ((char *) (H) + sizeof(shm_header_t) + (size_t) (I) * SHM_SIZE_THREAD(H)))
+
+#define SHM_BLOCK(T, I) ((shm_block_t *) ((T) + 1) + (I))
+
+#define HASH_EDGE(X) (((unsigned int) (X) * 2654435761U) >> 8)
+
+//return the edge to block edge_id, create it if it does not exist yet
+
+static inline edge_t *return_edge(profile_t *with, edges_t *with_edges,
+  int edge_id)
+{
+  if (with_edges->nedge_max > 0)
+  {
+    unsigned int mask = with_edges->nedge_max - 1;
+    unsigned int iedge = HASH_EDGE(edge_id) & mask;
+
+    while(with_edges->edge[iedge].edge_id != PROFILE_INVALID)
+    {
+      if (with_edges->edge[iedge].edge_id == edge_id)
+        return(with_edges->edge + iedge);
+
+      iedge = (iedge + 1) & mask;
+    }
+  }
+
+  //keep the load factor below one half
+
+  if (2 * (with_edges->nedge + 1) > with_edges->nedge_max)
+    grow_edges(with, with_edges);
+
+  unsigned int mask = with_edges->nedge_max - 1;
+  unsigned int iedge = HASH_EDGE(edge_id) & mask;
+
+  while(with_edges->edge[iedge].edge_id != PROFILE_INVALID)
+    iedge = (iedge + 1) & mask;
+
+  edge_t *with_edge = with_edges->edge + iedge;
+
+  with_edge->edge_id = edge_id;
+  with_edge->edge_calls = 0;
+  with_edge->edge_time_total = 0.0;
+  with_edge->edge_time_off_total = 0.0;
+
+  with_edges->nedge++;
+
+  return(with_edge);
+}
+
+static inline int return_bucket(long long ticks)
+{
+  if (ticks < HISTOGRAM_SUB) return(ticks < 0 ? 0 : (int) ticks);
+
+  int log2 = 63 - __builtin_clzll(ticks);
+
+  if (log2 >= HISTOGRAM_LOG2_MAX) return(NHISTOGRAM - 1);
+
+  return(((log2 - HISTOGRAM_BITS + 1) << HISTOGRAM_BITS) +
+         (int) ((ticks >> (log2 - HISTOGRAM_BITS)) & (HISTOGRAM_SUB - 1)));
+}
+
+static inline void update_histogram(histogram_t *with_histogram, long long ticks)
+{
+  with_histogram->histogram_count[return_bucket(ticks)]++;
+
+  if (ticks > with_histogram->histogram_ticks_max)
+    with_histogram->histogram_ticks_max = ticks;
+}
+
+#endif